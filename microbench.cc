@@ -0,0 +1,211 @@
+#include "perft.hh"
+
+#include "cxxopts.hh"
+
+#include <chrono>
+#include <functional>
+
+// Microbenchmarks of the move generation primitives, run over boards from the first plies of
+// the perft benchmark positions. Sliding attacks use whichever backend perft.hh is built with
+// (see the USE_* defines), so backends are compared by rebuilding.
+
+using Clock = std::chrono::steady_clock;
+
+// The positions of perft's --bench
+constexpr std::array<std::string_view, 7> CorpusFENs {
+	"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq -",
+	"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -",
+	"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - -",
+	"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq -",
+	"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ -",
+	"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - -",
+	"n1n5/PPPk4/8/8/8/8/4Kppp/5N1N b - -",
+};
+
+// Keeps a value alive so that the computation producing it isn't optimised away
+template <typename T> inline void do_not_optimize(const T &value)
+{
+#if defined(__GNUC__)
+	asm volatile("" : : "r,m"(value) : "memory");
+#else
+	static volatile char sink;
+	sink = *reinterpret_cast<const volatile char *>(&value);
+#endif
+}
+
+struct Corpus
+{
+	std::vector<Board> boards;
+	std::vector<std::pair<Square, Bitboard>> sliders; // Slider squares and board occupancies
+	// Legal moves (and the index of their board) by moving piece type
+	std::array<std::vector<std::pair<std::uint32_t, Move>>, PieceTypes> moves;
+};
+
+// Collects the boards of the first plies of each position's tree (breadth-first, up to
+// 'per_position' of them) and the sliders and legal moves of those boards
+Corpus make_corpus(const std::size_t per_position)
+{
+	Corpus corpus;
+
+	for (const auto fen : CorpusFENs)
+	{
+		Board root;
+		if (const auto status = parse_fen(root, fen); status != 0)
+			throw std::runtime_error(fmt::format("FEN parser returned {} for '{}'", status, fen));
+
+		const auto first = corpus.boards.size();
+		corpus.boards.push_back(root);
+
+		for (auto i = first; i < corpus.boards.size(); ++i)
+		{
+			const auto board = corpus.boards[i];
+
+			for (const auto &move : legal_moves(board))
+			{
+				if (corpus.boards.size() - first == per_position)
+					break;
+
+				Board child = board;
+				make_move(child, move);
+				corpus.boards.push_back(child);
+			}
+		}
+	}
+
+	for (std::uint32_t i = 0; i < corpus.boards.size(); ++i)
+	{
+		const auto &board = corpus.boards[i];
+		const auto occ = board.white_pieces | board.black_pieces;
+
+		for (auto bb = (board.bishops_queens | board.rooks_queens) & occ; bb; bb &= bb - 1)
+			corpus.sliders.emplace_back(static_cast<Square>(lsb(bb)), occ);
+
+		for (const auto &move : legal_moves(board))
+			corpus.moves[to_int(move.piece)].emplace_back(i, move);
+	}
+
+	return corpus;
+}
+
+// Calls 'op' on every element of 'items', over and over until 'budget' has passed, and
+// prints the time per call
+template <typename Items, typename Op>
+void run(const std::string_view name, const Items &items, const Clock::duration budget, Op op)
+{
+	if (items.empty())
+		return;
+
+	std::uint64_t ops = 0;
+	const auto t0 = Clock::now();
+	auto t1 = t0;
+
+	do
+	{
+		for (const auto &item : items)
+			op(item);
+
+		ops += items.size();
+		t1 = Clock::now();
+	} while (t1 - t0 < budget);
+
+	const auto ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / ops;
+
+	fmt::print("{: <28} {: <10} {: <10.2f} {:.0f}\n", name, items.size(), ns, 1e9 / ns);
+	std::fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	cxxopts::Options options("Microbench", "Microbenchmarks of perft's move generation "
+										   "primitives");
+	options.add_options()
+		("boards", "Number of boards taken from each benchmark position's tree",
+			cxxopts::value<std::size_t>()->default_value("4096"))
+		("time", "Time in ms to run each primitive for",
+			cxxopts::value<unsigned>()->default_value("500"))
+		("filter", "Only run the primitives whose names contain this",
+			cxxopts::value<std::string>()->default_value(""))
+		("h,help", "Show usage");
+
+	const auto result = options.parse(argc, argv);
+
+	if (result.count("help"))
+	{
+		fmt::print("{}\n", options.help());
+		return 0;
+	}
+
+	const auto boards = util::max(result["boards"].as<std::size_t>(), std::size_t(1));
+	const auto corpus = make_corpus(boards);
+	const auto budget = std::chrono::milliseconds(result["time"].as<unsigned>());
+	const auto filter = result["filter"].as<std::string>();
+
+	fmt::print("{} boards, {} sliders\n\n", corpus.boards.size(), corpus.sliders.size());
+	fmt::print("{: <28} {: <10} {: <10} {}\n", "Primitive", "Corpus", "ns/op", "ops/s");
+
+	const auto bench = [&](const std::string_view name, const auto &items, auto op) {
+		if (name.find(filter) != std::string_view::npos)
+			run(name, items, budget, op);
+	};
+
+	const auto attacks = [&](const std::string_view name, auto attacks_fn) {
+		bench(name, corpus.sliders, [&](const std::pair<Square, Bitboard> &slider) {
+			do_not_optimize(attacks_fn(slider.first, slider.second));
+		});
+	};
+
+	attacks("attacks_from<Bishop>", [](Square sq, Bitboard occ) {
+		return attacks_from<Bishop>(sq, occ);
+	});
+	attacks("attacks_from<Rook>", [](Square sq, Bitboard occ) {
+		return attacks_from<Rook>(sq, occ);
+	});
+	attacks("attacks_from<Queen>", [](Square sq, Bitboard occ) {
+		return attacks_from<Queen>(sq, occ);
+	});
+
+	// The loop-based reference implementation, for comparison with the backend
+	attacks("sliding_attacks<Bishop>", [](Square sq, Bitboard occ) {
+		return sliding_attacks<Bishop>(sq, occ);
+	});
+	attacks("sliding_attacks<Rook>", [](Square sq, Bitboard occ) {
+		return sliding_attacks<Rook>(sq, occ);
+	});
+
+	bench("pinned_pieces", corpus.boards, [](const Board &board) {
+		do_not_optimize(board.side == White ? pinned_pieces<White>(board)
+											: pinned_pieces<Black>(board));
+	});
+
+	bench("unsafe_squares", corpus.boards, [](const Board &board) {
+		do_not_optimize(board.side == White ? unsafe_squares<White>(board)
+											: unsafe_squares<Black>(board));
+	});
+
+	bench("checks", corpus.boards, [](const Board &board) {
+		do_not_optimize(board.side == White ? checks<White>(board) : checks<Black>(board));
+	});
+
+	bench("count_moves", corpus.boards, [](const Board &board) {
+		do_not_optimize(board.side == White ? count_moves<White>(board)
+											: count_moves<Black>(board));
+	});
+
+	// Through make_move, whose switch on the piece type is perfectly predicted here
+	const auto moves = [&](const std::string_view name, const PieceType piece) {
+		bench(name, corpus.moves[to_int(piece)], [&](const std::pair<std::uint32_t, Move> &move) {
+			auto board = corpus.boards[move.first];
+			make_move(board, move.second);
+			do_not_optimize(board);
+		});
+	};
+
+	moves("do_move<Pawn>", Pawn);
+	moves("do_move<Knight>", Knight);
+	moves("do_move<Bishop>", Bishop);
+	moves("do_move<Rook>", Rook);
+	moves("do_move<Queen>", Queen);
+	moves("do_move<King>", King);
+
+	return 0;
+}
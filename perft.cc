@@ -2,11 +2,41 @@
 
 #include "cxxopts.hh"
 
+#include <atomic>
+#include <cctype>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <tuple>
+
+#if defined(__linux__)
+#	include <linux/perf_event.h>
+#	include <sched.h>
+#	include <sys/ioctl.h>
+#	include <sys/syscall.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#	include <csignal>
+#	include <fcntl.h>
+#	include <sys/socket.h>
+#	include <sys/stat.h>
+#	include <sys/un.h>
+#	include <sys/wait.h>
+#	include <unistd.h>
+#endif
 
 using Microseconds = std::chrono::microseconds;
 using Milliseconds = std::chrono::milliseconds;
-using Clock = std::chrono::high_resolution_clock;
+using Clock = std::chrono::steady_clock;
 using std::chrono::duration_cast;
 
 #if defined(NDEBUG)
@@ -39,13 +69,381 @@ static std::array<NameFENDepth, 7> PredefinedFENs
 		IncreaseDepth ? 7 : 6}
 }};
 
-template <bool Divide = false> Nodes perft(const Board &board, const Depth depth)
+template <bool Divide = false, typename Counter = Nodes>
+Counter perft(const Board &board, const Depth depth)
+{
+	return board.side == White ? perft_dispatch<White, Divide, Counter>(board, depth)
+							   : perft_dispatch<Black, Divide, Counter>(board, depth);
+}
+
+// A subtree to count, with the index of the root move it's under and its estimated size
+struct Subtree
+{
+	Board board;
+	std::size_t root;
+	Depth depth;
+	double weight;
+};
+
+// Estimates the size of a subtree by a shallow perft, extrapolated geometrically
+double subtree_weight(const Board &board, const Depth depth)
+{
+	const Depth shallow = util::min<Depth>(depth, 2);
+	const auto size = util::max<double>(perft(board, shallow), 1);
+
+	return std::pow(size, double(depth) / shallow);
+}
+
+// Perft of each root move, with the root moves' subtrees shared out between threads. With
+// several threads the subtrees are taken largest first, so that a big one isn't left to run
+// alone at the end, and if 'split' is non-zero, those larger than 1/(split * threads) of the
+// total are first split into their children. If 'busy' is given, the seconds the threads
+// spent counting are added to it.
+std::vector<Nodes> perft_root_moves(const Board &board, const MoveList &moves, const Depth depth,
+									const unsigned threads, const unsigned split = 0,
+									std::atomic<double> *busy = nullptr)
+{
+	// Subtrees of at most this depth aren't estimated or split, as the estimate would cost too
+	// large a share of their count
+	constexpr Depth MinWeighted = 3;
+	constexpr std::size_t MaxSubtrees = 1 << 12;
+
+	// Profiling builds don't estimate, as the estimates' perfts would be counted in the profile
+	const bool weighted = !Profiling && threads > 1 && depth > MinWeighted;
+
+	std::vector<Subtree> subtrees;
+	double total_weight = 0;
+
+	for (std::size_t i = 0; i < moves.size; ++i)
+	{
+		Board child = board;
+		make_move(child, moves[i]);
+
+		const auto weight = weighted ? subtree_weight(child, depth - 1) : 0;
+		subtrees.push_back({child, i, Depth(depth - 1), weight});
+		total_weight += weight;
+	}
+
+	const auto lighter = [](const Subtree &a, const Subtree &b) { return a.weight < b.weight; };
+
+	if (weighted && split)
+	{
+		const auto limit = total_weight / (double(split) * threads);
+
+		std::make_heap(subtrees.begin(), subtrees.end(), lighter);
+
+		// Subtrees without moves add no children, so the heap can run out
+		while (!subtrees.empty() && subtrees.size() < MaxSubtrees &&
+			   subtrees.front().weight > limit && subtrees.front().depth > MinWeighted)
+		{
+			std::pop_heap(subtrees.begin(), subtrees.end(), lighter);
+			const auto parent = subtrees.back();
+			subtrees.pop_back();
+
+			for (const auto &move : legal_moves(parent.board))
+			{
+				Board child = parent.board;
+				make_move(child, move);
+
+				subtrees.push_back({child, parent.root, Depth(parent.depth - 1),
+									subtree_weight(child, parent.depth - 1)});
+				std::push_heap(subtrees.begin(), subtrees.end(), lighter);
+			}
+		}
+	}
+
+	if (weighted)
+		std::sort(subtrees.begin(), subtrees.end(),
+				  [&](const auto &a, const auto &b) { return lighter(b, a); });
+
+	std::vector<Nodes> counts(subtrees.size());
+
+	std::atomic<std::size_t> next {0};
+	std::vector<std::thread> workers;
+
+	for (unsigned i = 0; i < threads; ++i)
+	{
+		workers.emplace_back([&] {
+			const auto t0 = Clock::now();
+
+			for (auto j = next++; j < subtrees.size(); j = next++)
+				counts[j] = perft(subtrees[j].board, subtrees[j].depth);
+
+			if (busy)
+			{
+				const auto dt = std::chrono::duration<double>(Clock::now() - t0).count();
+				for (auto b = busy->load(); !busy->compare_exchange_weak(b, b + dt);)
+					;
+			}
+		});
+	}
+
+	for (auto &worker : workers)
+		worker.join();
+
+	std::vector<Nodes> nodes(moves.size);
+	for (std::size_t j = 0; j < subtrees.size(); ++j)
+		nodes[subtrees[j].root] += counts[j];
+
+	return nodes;
+}
+
+Nodes perft_parallel(const Board &board, const Depth depth, const unsigned threads,
+					 const unsigned split = 0, std::atomic<double> *busy = nullptr)
+{
+	if ((threads == 1 && !busy) || depth < 2)
+		return perft(board, depth);
+
+	Nodes total = 0;
+	for (const auto nodes :
+		 perft_root_moves(board, legal_moves(board), depth, threads, split, busy))
+		total += nodes;
+
+	return total;
+}
+
+//
+// Progress reporting
+//  A perft with progress is split into the subtrees after each root move and reply, which
+//  threads take largest first and only count into the shared totals once finished. Every
+//  second a reporter thread prints those totals to stderr, with an ETA extrapolated from the
+//  estimated sizes of the finished and remaining subtrees.
+//
+
+// Formats a duration in seconds as "1h02m03s", "2m03s" or "3s"
+std::string format_seconds(const double seconds)
+{
+	const auto s = static_cast<std::uint64_t>(seconds);
+
+	if (s >= 3600)
+		return fmt::format("{}h{:02}m{:02}s", s / 3600, s / 60 % 60, s % 60);
+
+	if (s >= 60)
+		return fmt::format("{}m{:02}s", s / 60, s % 60);
+
+	return fmt::format("{}s", s);
+}
+
+Nodes perft_progress(const Board &board, const Depth depth, const unsigned threads)
 {
-	return board.side == White ? perft_colour<White, Divide>(board, depth)
-							   : perft_colour<Black, Divide>(board, depth);
+	if (depth < 3)
+		return perft_parallel(board, depth, threads);
+
+	const auto roots = legal_moves(board);
+
+	std::vector<Subtree> units;
+	std::vector<std::size_t> pending(roots.size);
+	std::size_t roots_done = 0;
+
+	for (std::size_t i = 0; i < roots.size; ++i)
+	{
+		Board child = board;
+		make_move(child, roots[i]);
+
+		const auto replies = legal_moves(child);
+		pending[i] = replies.size;
+		roots_done += replies.size == 0;
+
+		for (const auto &reply : replies)
+		{
+			Board grandchild = child;
+			make_move(grandchild, reply);
+
+			units.push_back({grandchild, i, Depth(depth - 2),
+							 subtree_weight(grandchild, depth - 2)});
+		}
+	}
+
+	std::sort(units.begin(), units.end(),
+			  [](const auto &a, const auto &b) { return a.weight > b.weight; });
+
+	double total_weight = 0;
+	for (const auto &unit : units)
+		total_weight += unit.weight;
+
+	std::mutex mutex;
+	std::condition_variable finished;
+	std::size_t workers_left = threads;
+
+	std::atomic<std::size_t> next {0};
+	std::atomic<Nodes> nodes {0};
+	double done_weight = 0; // Guarded by 'mutex', like 'pending' and 'roots_done'
+
+	const auto t0 = Clock::now();
+
+#if defined(__unix__) || defined(__APPLE__)
+	const bool terminal = isatty(STDERR_FILENO);
+#else
+	const bool terminal = false;
+#endif
+
+	std::thread reporter([&] {
+		std::unique_lock lock(mutex);
+
+		// The rate is over the last interval; the ETA uses the average since the start
+		double last_elapsed = 0;
+		Nodes last_done = 0;
+
+		while (!finished.wait_for(lock, std::chrono::seconds(1), [&] { return !workers_left; }))
+		{
+			const auto elapsed = std::chrono::duration<double>(Clock::now() - t0).count();
+			const auto done = nodes.load(std::memory_order_relaxed);
+			const auto fraction = done_weight / total_weight;
+			const auto rate = (done - last_done) / (elapsed - last_elapsed);
+
+			last_elapsed = elapsed;
+			last_done = done;
+
+			fmt::print(stderr, "{}Depth {}: {} nodes, {:.0f} nodes/sec, root moves {}/{}, ETA {}{}",
+					   terminal ? "\r" : "", depth, done, rate, roots_done, roots.size,
+					   fraction > 0 ? format_seconds(elapsed * (1 - fraction) / fraction) : "?",
+					   terminal ? "\x1b[K" : "\n");
+			std::fflush(stderr);
+		}
+
+		if (terminal)
+			fmt::print(stderr, "\r\x1b[K");
+	});
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < threads; ++i)
+	{
+		workers.emplace_back([&] {
+			for (auto j = next++; j < units.size(); j = next++)
+			{
+				const auto count = perft(units[j].board, units[j].depth);
+				nodes.fetch_add(count, std::memory_order_relaxed);
+
+				std::lock_guard lock(mutex);
+				done_weight += units[j].weight;
+				roots_done += --pending[units[j].root] == 0;
+			}
+
+			std::lock_guard lock(mutex);
+			if (--workers_left == 0)
+				finished.notify_one();
+		});
+	}
+
+	for (auto &worker : workers)
+		worker.join();
+
+	reporter.join();
+
+	return nodes;
 }
 
 std::string compiler_info();
+std::string_view slider_backend();
+std::string_view fill_backend();
+std::string build_flags();
+
+//
+// Machine-readable output
+//  With --format json or csv, each result is written as it's produced: one JSON object per
+//  line, or one CSV row (after a header row).
+//
+
+enum class Format
+{
+	Text,
+	Json,
+	Csv
+};
+
+struct Record
+{
+	std::string_view mode, name, fen, move;
+	unsigned depth = 0;
+	Nodes nodes = 0;
+	Microseconds time {};
+	unsigned threads = 1;
+	std::string_view error = "";
+	double speedup = 0, efficiency = 0, idle = 0; // --bench-scaling only, as fractions
+};
+
+std::string json_escape(std::string_view s)
+{
+	std::string out;
+
+	for (const auto c : s)
+	{
+		if (c == '"' || c == '\\')
+			out += '\\';
+
+		out += c;
+	}
+
+	return out;
+}
+
+std::string csv_field(std::string_view s)
+{
+	if (s.find_first_of(",\"\n") == std::string_view::npos)
+		return std::string(s);
+
+	std::string out = "\"";
+	for (const auto c : s)
+		out += c == '"' ? "\"\"" : std::string(1, c);
+
+	return out + "\"";
+}
+
+std::string csv_header()
+{
+	return "mode,name,fen,move,depth,nodes,us,nodes_per_sec,threads,backend,flags,error,speedup,"
+		   "efficiency,idle\n";
+}
+
+std::string format_record(const Format format, const Record &r)
+{
+	const auto us = r.time.count();
+	const auto nps = us > 0 ? (1e6 * r.nodes) / us : 0.0;
+
+	if (format == Format::Json)
+	{
+		return fmt::format("{{\"mode\":\"{}\",\"name\":\"{}\",\"fen\":\"{}\",\"move\":\"{}\","
+						   "\"depth\":{},\"nodes\":{},\"us\":{},\"nodes_per_sec\":{:.0f},"
+						   "\"threads\":{},\"backend\":\"{}\",\"flags\":\"{}\","
+						   "\"error\":\"{}\",\"speedup\":{:.3f},\"efficiency\":{:.3f},"
+						   "\"idle\":{:.3f}}}\n",
+						   r.mode, json_escape(r.name), json_escape(r.fen), r.move, r.depth,
+						   r.nodes, us, nps, r.threads, slider_backend(), build_flags(),
+						   json_escape(r.error), r.speedup, r.efficiency, r.idle);
+	}
+
+	return fmt::format("{},{},{},{},{},{},{},{:.0f},{},{},{},{},{:.3f},{:.3f},{:.3f}\n", r.mode,
+					   csv_field(r.name), csv_field(r.fen), r.move, r.depth, r.nodes, us, nps,
+					   r.threads, csv_field(slider_backend()), csv_field(build_flags()),
+					   csv_field(r.error), r.speedup, r.efficiency, r.idle);
+}
+
+void print_record(const Format format, const Record &record)
+{
+	fmt::print("{}", format_record(format, record));
+	std::fflush(stdout);
+}
+
+struct BenchOptions
+{
+	unsigned runs = 1, warmup = 0;
+	int cpu = -1; // CPU to pin the benchmark to, or -1
+	bool counters = false;
+	std::string save_baseline, compare; // Baseline files, if given
+	double threshold = 2;				// Smallest change (%) reported as a regression
+};
+
+int run_bench(const BenchOptions &options, Format format);
+int run_bench_scaling(unsigned max_threads, unsigned split, Format format);
+void print_profile(const Profile &profile, Depth depth, Nodes leaves);
+int run_suite(const std::string &path, Depth max_depth, unsigned threads);
+int run_generate(std::size_t count, std::uint64_t seed, Depth depth, unsigned threads);
+int run_bench_corpus(const std::string &path, Depth max_depth, unsigned runs, Format format);
+int run_batch(unsigned threads, bool ordered, Format format);
+int run_server(const std::string &path, unsigned threads);
+int run_uci(unsigned threads);
+int run_verify(const std::string &engine, const std::string &fen,
+			   const std::vector<std::string> &moves, Depth depth, unsigned threads);
 
 int main(int argc, char *argv[])
 {
@@ -57,7 +455,58 @@ int main(int argc, char *argv[])
 		("d,depth", "Depth", cxxopts::value<unsigned>())
 		("u,upto", "Calculate for depths 1...n")
 		("b,bench", "Benchmark mode")
+		("bench-runs", "Number of timed runs of each position for --bench",
+			cxxopts::value<unsigned>()->default_value("1"))
+		("bench-warmup", "Number of untimed runs of each position before --bench times it",
+			cxxopts::value<unsigned>()->default_value("0"))
+		("bench-scaling", "Run the benchmark at 1, 2, 4, ... threads, up to -t (or all cores)")
+		("pin", "Pin --bench to the given CPU", cxxopts::value<int>())
+		("counters", "Read hardware performance counters during --bench (Linux)")
+		("save-baseline", "Save the --bench results as a baseline to the given file",
+			cxxopts::value<std::string>())
+		("compare", "Compare the --bench results to the baseline in the given file, failing on a "
+			"significant regression", cxxopts::value<std::string>())
+		("threshold", "Smallest nodes/sec loss (%) that --compare treats as a regression",
+			cxxopts::value<double>()->default_value("2"))
 		("divide", "Print move counts for each root move")
+		("s,stats", "Classify leaf moves (captures, checks, etc.) like the CPW perft tables")
+		("e,estimate", "Estimate the perft by sampling random paths (see --samples, --time)")
+		("samples", "Number of samples for --estimate",
+			cxxopts::value<std::uint64_t>()->default_value("1000000"))
+		("time", "Time budget in ms for --estimate (0 for no limit)",
+			cxxopts::value<unsigned>()->default_value("0"))
+		("profile", "Profile the perft's positions and generator paths per ply (needs a build "
+			"with USE_PROFILE)")
+		("unique", "Count distinct positions (rather than move paths) at exactly the given depth")
+		("memory", "Memory limit in MB for --unique, beyond which positions are spilled to disk",
+			cxxopts::value<std::size_t>()->default_value("1024"))
+		("symmetric", "With --unique, count positions that are file mirrors of each other (neither "
+			"side able to castle) once")
+		("suite", "Run the perft suite in an EPD file (\"fen ;D1 20 ;D2 400 ...\"), up to --depth "
+			"if given", cxxopts::value<std::string>())
+		("batch", "Read \"fen depth\" lines from stdin, write \"fen depth nodes time (us)\" lines "
+			"to stdout")
+		("ordered", "Write --batch results in input order")
+		("generate", "Write an EPD perft suite (up to --depth, default 4) of this many random "
+			"positions, stratified by phase, material balance and check",
+			cxxopts::value<std::size_t>())
+		("seed", "Seed for --generate (default 1) and --estimate (default 0)",
+			cxxopts::value<std::uint64_t>())
+		("corpus", "Run --bench on the deepest perft of each position in an EPD suite (up to "
+			"--depth if given)", cxxopts::value<std::string>())
+		("serve", "Serve line-JSON perft requests on a UNIX domain socket at the given path",
+			cxxopts::value<std::string>())
+		("uci", "Speak UCI on stdin/stdout, supporting \"go perft <depth>\"")
+		("v,verify", "Compare perft results to another UCI engine (command line), bisecting "
+			"mismatches to the first differing move", cxxopts::value<std::string>())
+		("progress", "Report the progress of long perfts on stderr")
+		("t,threads", "Number of threads (root moves are shared out between them)",
+			cxxopts::value<unsigned>()->default_value("1"))
+		("split", "With several threads, split root subtrees larger than 1/(split * threads) of "
+			"the perft before sharing them out (0 to not split)",
+			cxxopts::value<unsigned>()->default_value("0"))
+		("format", "Output format for bench, upto, divide and batch: text, json or csv",
+			cxxopts::value<std::string>()->default_value("text"))
 		("c,compiler", "Show compiler info");
 
 	auto result = options.parse(argc, argv);
@@ -65,13 +514,19 @@ int main(int argc, char *argv[])
 	if (result["compiler"].as<bool>())
 		fmt::print("{}\n", compiler_info());
 
-	//unsigned threads =
-	//	util::clamp(result["threads"].as<unsigned>(), 1u, std::thread::hardware_concurrency());
+	unsigned threads = util::clamp(result["threads"].as<unsigned>(), 1u,
+								   util::max(std::thread::hardware_concurrency(), 1u));
+	const auto split = result["split"].as<unsigned>();
 
 	bool upto = result["upto"].as<bool>();
 	bool bench = result["bench"].as<bool>();
 	bool divide = result["divide"].as<bool>();
-	bool verify = false/*result.count("verify")*/;
+	bool stats = result["stats"].as<bool>();
+	bool estimate = result["estimate"].as<bool>();
+	bool unique = result["unique"].as<bool>();
+	bool profiling = result["profile"].as<bool>();
+	bool progress = result["progress"].as<bool>();
+	bool verify = result.count("verify");
 
 	if ((bench && (divide || upto || verify)) || (upto && (divide || bench || verify)) ||
 		(verify && (divide || bench || upto)) || (divide && (bench || upto || verify)))
@@ -80,11 +535,67 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	if (stats && (bench || divide || verify))
+	{
+		fmt::print("Incorrect usage: stats cannot be combined with bench, divide or verify\n");
+		return 0;
+	}
+
+	if (estimate && (bench || divide || verify || stats))
+	{
+		fmt::print("Incorrect usage: estimate cannot be combined with bench, divide, verify or "
+				   "stats\n");
+		return 0;
+	}
+
+	if (unique && (bench || divide || verify || stats || estimate))
+	{
+		fmt::print("Incorrect usage: unique cannot be combined with bench, divide, verify, stats "
+				   "or estimate\n");
+		return 0;
+	}
+
+	if (profiling && (bench || divide || upto || verify || stats || estimate || unique))
+	{
+		fmt::print("Incorrect usage: profile cannot be combined with bench, divide, upto, verify, "
+				   "stats, estimate or unique\n");
+		return 0;
+	}
+
+	if (profiling && !Profiling)
+	{
+		fmt::print("Error: --profile needs a build with USE_PROFILE defined (see perft.hh)\n");
+		return 1;
+	}
+
+	const auto format_name = result["format"].as<std::string>();
+	const auto format = format_name == "json" ? Format::Json
+						: format_name == "csv" ? Format::Csv
+											   : Format::Text;
+
+	if (format_name != "text" && format == Format::Text)
+	{
+		fmt::print("Incorrect usage: format must be text, json or csv\n");
+		return 0;
+	}
+
+	if (format != Format::Text &&
+		(stats || estimate || unique || profiling || verify || result.count("suite") ||
+		 result.count("generate") || result.count("serve") || result["uci"].as<bool>()))
+	{
+		fmt::print("Incorrect usage: format only applies to bench, upto, divide and batch\n");
+		return 0;
+	}
+
+	if (format == Format::Csv)
+		fmt::print("{}", csv_header());
+
 	Depth depth = result.count("depth") ? result["depth"].as<unsigned>() : 0;
 
 	if (result.count("fen"))
 	{
 		std::string fen = result["fen"].as<std::string>();
+		std::string_view name;
 
 		for (const auto &name_fen_depth : PredefinedFENs)
 		{
@@ -93,6 +604,8 @@ int main(int argc, char *argv[])
 
 			if (name_fen_depth.fen == fen)
 			{
+				name = name_fen_depth.name;
+
 				if (depth == 0)
 					depth = name_fen_depth.depth;
 
@@ -113,7 +626,7 @@ int main(int argc, char *argv[])
 			{
 				const auto moves = result["moves"].as<std::vector<std::string>>();
 				for (const auto &move : moves)
-					if (status = parse_and_push_uci(board, move); status != 0)
+					if (status = push_legal_uci(board, move); status != 0)
 					{
 						fmt::print(
 							"Error: move parser returned non-zero code {} when parsing '{}'\n",
@@ -122,7 +635,156 @@ int main(int argc, char *argv[])
 					}
 			}
 
-			fmt::print("{}\n", to_string(board));
+			if (format == Format::Text)
+				fmt::print("{}\n", to_string(board));
+
+			if (verify)
+			{
+				const auto moves = result.count("moves")
+									   ? result["moves"].as<std::vector<std::string>>()
+									   : std::vector<std::string> {};
+
+				return run_verify(result["verify"].as<std::string>(), fen, moves, depth, threads);
+			}
+
+			if (estimate)
+			{
+				const auto samples = result["samples"].as<std::uint64_t>();
+				const auto budget = Milliseconds(result["time"].as<unsigned>());
+				const auto seed = result.count("seed") ? result["seed"].as<std::uint64_t>() : 0;
+
+				fmt::print("{: <6} {: <22} {: <22} {: <12} {}\n", "Depth", "Estimate",
+						   "95% CI (+/-)", "Samples", "Time (ms)");
+
+				for (Depth d = (upto ? 1 : depth); d <= depth; ++d)
+				{
+					const auto t0 = Clock::now();
+					const auto e = estimate_perft(board, d, samples, budget, threads, 2, seed);
+					const auto t1 = Clock::now();
+
+					fmt::print("{: <6} {: <22.6e} {: <22.6e} {: <12} {}\n", d, e.mean, e.interval(),
+							   e.samples, duration_cast<Milliseconds>(t1 - t0).count());
+				}
+
+				return 0;
+			}
+
+			if (unique)
+			{
+				const auto memory = result["memory"].as<std::size_t>() << 20;
+				const auto symmetric = result["symmetric"].as<bool>();
+
+				fmt::print("{: <6} {: <12} {: <6} {}\n", "Depth", "Positions", "Runs",
+						   "Time (ms)");
+
+				for (Depth d = (upto ? 1 : depth); d <= depth; ++d)
+				{
+					const auto t0 = Clock::now();
+					UniqueCount u;
+
+					try
+					{
+						u = count_unique(board, d, memory, threads, symmetric);
+					}
+					catch (const std::exception &e)
+					{
+						fmt::print("Error: {}\n", e.what());
+						return 1;
+					}
+
+					const auto t1 = Clock::now();
+
+					fmt::print("{: <6} {: <12} {: <6} {}\n", d, u.positions, u.runs,
+							   duration_cast<Milliseconds>(t1 - t0).count());
+				}
+
+				return 0;
+			}
+
+			if (profiling)
+			{
+				profile_reset();
+
+				const auto t0 = Clock::now();
+				const auto nodes = perft_parallel(board, depth, threads, split);
+				const auto t1 = Clock::now();
+
+				fmt::print("Depth {}: {} nodes, {} ms\n\n", depth, nodes,
+						   duration_cast<Milliseconds>(t1 - t0).count());
+				print_profile(profile_snapshot(), depth, nodes);
+
+				return 0;
+			}
+
+			if (stats)
+			{
+				fmt::print("{: <6} {: <12} {: <10} {: <8} {: <8} {: <10} {: <10} {: <10} {: <10} "
+						   "{}\n",
+						   "Depth", "Nodes", "Captures", "E.p.", "Castles", "Promotions", "Checks",
+						   "Disc. chk", "Dbl. chk", "Checkmates");
+
+				for (Depth d = (upto ? 1 : depth); d <= depth; ++d)
+				{
+					const auto s = perft<false, Stats>(board, d);
+
+					fmt::print("{: <6} {: <12} {: <10} {: <8} {: <8} {: <10} {: <10} {: <10} "
+							   "{: <10} {}\n",
+							   d, s.nodes, s.captures, s.en_passants, s.castles, s.promotions,
+							   s.checks, s.discovery_checks, s.double_checks, s.checkmates);
+				}
+
+				return 0;
+			}
+
+			if (format != Format::Text)
+			{
+				// The records give the position the perft is of, after any -m moves
+				const auto position = result.count("moves") ? to_fen(board) : fen;
+
+				for (Depth d = (upto ? 1 : depth); d <= depth; ++d)
+				{
+					Record record {divide ? "divide" : "perft", name, position, "", d};
+					record.threads = threads;
+
+					if (divide)
+					{
+						const auto moves = legal_moves(board);
+
+						for (std::size_t i = 0; i < moves.size; ++i)
+						{
+							// Each root move's subtree is counted separately to time it
+							Board child = board;
+							make_move(child, moves[i]);
+
+							const auto t0 = Clock::now();
+							const auto nodes = perft(child, d - 1);
+							const auto t1 = Clock::now();
+
+							const auto move = fmt::format("{}", moves[i]);
+							Record move_record = record;
+							move_record.move = move;
+							move_record.nodes = nodes;
+							move_record.time = duration_cast<Microseconds>(t1 - t0);
+							move_record.threads = 1;
+							print_record(format, move_record);
+
+							record.nodes += nodes;
+							record.time += move_record.time;
+						}
+					}
+					else
+					{
+						const auto t0 = Clock::now();
+						record.nodes = progress ? perft_progress(board, d, threads)
+												: perft_parallel(board, d, threads, split);
+						record.time = duration_cast<Microseconds>(Clock::now() - t0);
+					}
+
+					print_record(format, record);
+				}
+
+				return 0;
+			}
 
 			if (!divide)
 			{
@@ -134,7 +796,9 @@ int main(int argc, char *argv[])
 			for (Depth d = (upto ? 1 : depth); d <= depth; ++d)
 			{
 				const auto t0 = Clock::now();
-				nodes = divide ? perft<true>(board, d) : perft<false>(board, d);
+				nodes = divide	   ? perft<true>(board, d)
+						: progress ? perft_progress(board, d, threads)
+								   : perft_parallel(board, d, threads, split);
 				const auto t1 = Clock::now();
 				const auto dt = duration_cast<Microseconds>(t1 - t0);
 
@@ -158,55 +822,2035 @@ int main(int argc, char *argv[])
 			return 0;
 		}
 	}
+	else if (bench && result.count("corpus"))
+	{
+		return run_bench_corpus(result["corpus"].as<std::string>(), depth,
+								util::max(result["bench-runs"].as<unsigned>(), 1u), format);
+	}
+	else if (bench && result["bench-scaling"].as<bool>())
+	{
+		const auto cores = util::max(std::thread::hardware_concurrency(), 1u);
+		return run_bench_scaling(result.count("threads") ? threads : cores, split, format);
+	}
 	else if (bench)
 	{
-		fmt::print("{: <10} {: <6} {: <12} {: <12} {}\n", "Name", "Depth", "Nodes", "Time (ms)",
-				   "Nodes/sec");
-
-		Nodes total_nodes = 0, nodes;
-		Milliseconds total_time {};
-		for (const auto &name_fen_depth : PredefinedFENs)
-		{
-			Board board;
-			if (const auto status = parse_fen(board, name_fen_depth.fen); status != 0)
-			{
-				fmt::print("Error: FEN parser returned non-zero code {} when parsing '{}' ({})\n",
-						   status, name_fen_depth.fen);
-				break;
-			}
-
-			const auto t0 = Clock::now();
-			nodes = perft(board, name_fen_depth.depth);
-			const auto t1 = Clock::now();
-			const auto dt = duration_cast<Microseconds>(t1 - t0);
+		BenchOptions bench_options;
+		bench_options.runs = util::max(result["bench-runs"].as<unsigned>(), 1u);
+		bench_options.warmup = result["bench-warmup"].as<unsigned>();
+		bench_options.cpu = result.count("pin") ? result["pin"].as<int>() : -1;
+		bench_options.counters = result["counters"].as<bool>();
+		bench_options.threshold = result["threshold"].as<double>();
 
-			total_nodes += nodes;
-			total_time += duration_cast<Milliseconds>(dt);
+		if (result.count("save-baseline"))
+			bench_options.save_baseline = result["save-baseline"].as<std::string>();
 
-			fmt::print("{: <10} {: <6} {: <12} {: <12} {:.0f}\n", name_fen_depth.name,
-					   name_fen_depth.depth, nodes, duration_cast<Milliseconds>(dt).count(),
-					   (1e6 * nodes) / dt.count());
-		}
+		if (result.count("compare"))
+			bench_options.compare = result["compare"].as<std::string>();
 
-		fmt::print("{: <10} {: <6} {: <12} {: <12} {:.0f}\n", "total/avg", '-', total_nodes,
-				   total_time.count(), (1e3 * total_nodes) / total_time.count());
+		return run_bench(bench_options, format);
 	}
-	else if (verify)
+	else if (result["uci"].as<bool>())
 	{
-		fmt::print("Not implemented.\n");
+		return run_uci(threads);
 	}
-	else
+	else if (result.count("serve"))
 	{
-		// Incorrect usage
-		fmt::print("{}\n{}\n", options.help(), "Predefined FENs:");
-		for (const auto &name_fen_depth : PredefinedFENs)
+		return run_server(result["serve"].as<std::string>(), threads);
+	}
+	else if (result["batch"].as<bool>())
+	{
+		return run_batch(threads, result["ordered"].as<bool>(), format);
+	}
+	else if (result.count("suite"))
+	{
+		return run_suite(result["suite"].as<std::string>(), depth, threads);
+	}
+	else if (result.count("generate"))
+	{
+		const auto count = result["generate"].as<std::size_t>();
+		const auto seed = result.count("seed") ? result["seed"].as<std::uint64_t>() : 1;
+		return run_generate(count, seed, depth ? depth : 4, threads);
+	}
+	else if (verify)
+	{
+		fmt::print("Error: --verify needs a position (-f)\n");
+		return 1;
+	}
+	else
+	{
+		// Incorrect usage
+		fmt::print("{}\n{}\n", options.help(), "Predefined FENs:");
+		for (const auto &name_fen_depth : PredefinedFENs)
 			fmt::print(" {: <10} {}\n", name_fen_depth.name, name_fen_depth.fen);
 	}
 
 	return 0;
 }
 
-inline std::string compiler_info()
+//
+// Benchmark
+//  Each predefined position is run 'warmup' times untimed and then 'runs' times timed. With
+//  several runs the median, minimum and relative standard deviation of each position's time
+//  are shown, and the total nodes/sec (the mean of each run's total rate) gets a 95%
+//  confidence interval.
+//
+
+// Two-sided 95% critical value of Student's t distribution
+double student_t95(const std::size_t df)
+{
+	static constexpr std::array<double, 30> Table {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+
+	return df == 0 ? HUGE_VAL : df <= Table.size() ? Table[df - 1] : 1.96;
+}
+
+double median(std::vector<double> values)
+{
+	std::sort(values.begin(), values.end());
+
+	const auto n = values.size();
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// Pins the calling thread to 'cpu'. Returns false if that isn't possible.
+bool pin_to_cpu(const int cpu)
+{
+#if defined(__linux__)
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return false;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+// Hardware performance counters of the calling thread (user space only), read with
+// perf_event_open. Counters which can't be opened (no PMU in a VM or container, or a
+// restrictive perf_event_paranoid) are reported as unavailable.
+class PerfCounters
+{
+public:
+	enum Event { Cycles, Instructions, BranchMisses, L1DMisses, LLCMisses, DTLBMisses, Events };
+
+	using Values = std::array<double, Events>; // NaN where unavailable
+
+	PerfCounters()
+	{
+		fds.fill(-1);
+
+#if defined(__linux__)
+		const auto cache = [](std::uint64_t id) {
+			return id | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		};
+
+		const std::array<std::pair<std::uint32_t, std::uint64_t>, Events> events {{
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+			{PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_L1D)},
+			{PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_LL)},
+			{PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_DTLB)},
+		}};
+
+		for (std::size_t i = 0; i < Events; ++i)
+		{
+			perf_event_attr attr {};
+			attr.size = sizeof(attr);
+			attr.type = events[i].first;
+			attr.config = events[i].second;
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			// The PMU may multiplex the counters, in which case the counts are scaled up
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+			fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+		}
+#endif
+	}
+
+	~PerfCounters()
+	{
+#if defined(__linux__)
+		for (const auto fd : fds)
+			if (fd >= 0)
+				close(fd);
+#endif
+	}
+
+	PerfCounters(const PerfCounters &) = delete;
+	PerfCounters &operator=(const PerfCounters &) = delete;
+
+	bool available() const
+	{
+		return std::any_of(fds.begin(), fds.end(), [](int fd) { return fd >= 0; });
+	}
+
+	void start()
+	{
+#if defined(__linux__)
+		for (const auto fd : fds)
+		{
+			if (fd >= 0)
+			{
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+
+	Values stop()
+	{
+		Values values;
+		values.fill(NAN);
+
+#if defined(__linux__)
+		for (std::size_t i = 0; i < Events; ++i)
+		{
+			if (fds[i] < 0)
+				continue;
+
+			ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+			std::uint64_t data[3]; // value, time enabled, time running
+			if (read(fds[i], data, sizeof(data)) == sizeof(data) && data[2] > 0)
+				values[i] = static_cast<double>(data[0]) * data[1] / data[2];
+		}
+#endif
+
+		return values;
+	}
+
+private:
+	std::array<int, Events> fds;
+};
+
+// A position's (or the total's) benchmark result: nodes/sec over the runs
+struct BenchResult
+{
+	std::string name;
+	Depth depth;
+	Nodes nodes;
+	Estimate rate;
+};
+
+constexpr std::string_view BaselineHeader = "# perft --bench baseline";
+
+// The host name and compiler_info() lines, which baselines record
+std::vector<std::string> bench_metadata()
+{
+	std::vector<std::string> metadata;
+
+#if defined(__unix__) || defined(__APPLE__)
+	std::array<char, 256> host {};
+	if (gethostname(host.data(), host.size() - 1) == 0)
+		metadata.push_back(fmt::format("Host: {}", host.data()));
+#endif
+
+	std::istringstream info(compiler_info());
+	for (std::string line; std::getline(info, line);)
+		metadata.push_back(line);
+
+	return metadata;
+}
+
+// Writes a baseline: "# " metadata lines, then "name depth nodes runs nodes/sec stddev" lines
+bool save_baseline(const std::string &path, const std::vector<BenchResult> &results)
+{
+	std::ofstream file(path);
+
+	file << BaselineHeader << '\n';
+	for (const auto &line : bench_metadata())
+		file << "# " << line << '\n';
+
+	for (const auto &r : results)
+	{
+		const auto stddev = r.rate.samples > 1 ? std::sqrt(r.rate.m2 / (r.rate.samples - 1)) : 0;
+
+		file << fmt::format("{} {} {} {} {:.0f} {:.0f}\n", r.name, r.depth, r.nodes,
+							r.rate.samples, r.rate.mean, stddev);
+	}
+
+	return bool(file);
+}
+
+// Compares results to a saved baseline. A position has regressed if its nodes/sec dropped by
+// more than 'threshold' percent and, when both sides have several runs, by more than Welch's
+// 95% confidence interval on the difference. Returns non-zero if anything regressed, or if no
+// result could be compared (an empty or unrelated baseline).
+int compare_baseline(const std::string &path, const std::vector<BenchResult> &results,
+					 const double threshold, std::FILE *out)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+		fmt::print(stderr, "Error: unable to read baseline '{}'\n", path);
+		return 1;
+	}
+
+	std::vector<std::string> metadata;
+	std::map<std::string, BenchResult> baseline;
+
+	for (std::string line; std::getline(file, line);)
+	{
+		if (line.rfind("# ", 0) == 0)
+		{
+			if (line != BaselineHeader)
+				metadata.push_back(line.substr(2));
+
+			continue;
+		}
+
+		std::istringstream fields(line);
+		BenchResult r;
+		unsigned depth;
+		double stddev;
+
+		if ((fields >> r.name >> depth >> r.nodes >> r.rate.samples >> r.rate.mean >> stddev) &&
+			depth <= 255)
+		{
+			r.depth = static_cast<Depth>(depth);
+			r.rate.m2 = r.rate.samples > 1 ? stddev * stddev * (r.rate.samples - 1) : 0;
+			baseline[r.name] = r;
+		}
+	}
+
+	if (metadata != bench_metadata())
+	{
+		fmt::print(out, "Warning: the baseline was recorded with a different host or build:\n");
+		for (const auto &line : metadata)
+			fmt::print(out, "  {}\n", line);
+	}
+
+	fmt::print(out, "\n{: <10} {: <14} {: <14} {: <9} {}\n", "Name", "Baseline N/s",
+			   "Current N/s", "Change", "Verdict");
+
+	auto regressions = 0, compared = 0;
+
+	for (const auto &r : results)
+	{
+		const auto it = baseline.find(r.name);
+		if (it == baseline.end() || it->second.nodes != r.nodes)
+		{
+			fmt::print(out, "{: <10} {: <14} {: <14} {: <9} {}\n", r.name, '-',
+					   fmt::format("{:.0f}", r.rate.mean), '-',
+					   it == baseline.end() ? "not in baseline" : "node count differs");
+			continue;
+		}
+
+		++compared;
+
+		const auto &b = it->second.rate;
+		const auto change = 100 * (r.rate.mean - b.mean) / b.mean;
+
+		// Without several runs on both sides the noise is unknown, so only the threshold counts
+		auto noise = 0.0;
+		if (r.rate.samples > 1 && b.samples > 1)
+		{
+			// Variances of the two means, and the Welch-Satterthwaite degrees of freedom
+			const auto v1 = r.rate.m2 / (r.rate.samples - 1) / r.rate.samples;
+			const auto v2 = b.m2 / (b.samples - 1) / b.samples;
+			const auto d = v1 * v1 / (r.rate.samples - 1) + v2 * v2 / (b.samples - 1);
+			const auto df = d > 0 ? (v1 + v2) * (v1 + v2) / d : r.rate.samples + b.samples - 2.0;
+
+			const auto t = student_t95(util::max<std::size_t>(df, 1));
+			noise = 100 * t * std::sqrt(v1 + v2) / b.mean;
+		}
+
+		const auto significant = std::abs(change) > util::max(threshold, noise);
+		const auto verdict = !significant ? "same" : change < 0 ? "SLOWER" : "faster";
+
+		if (significant && change < 0)
+			++regressions;
+
+		fmt::print(out, "{: <10} {: <14.0f} {: <14.0f} {: <9} {}\n", r.name, b.mean, r.rate.mean,
+				   fmt::format("{:+.2f}%", change), verdict);
+	}
+
+	if (compared == 0)
+		fmt::print(out, "\nNo result matches the baseline\n");
+	else if (regressions)
+		fmt::print(out, "\n{} regression(s) of more than {}% beyond the noise\n", regressions,
+				   threshold);
+	else
+		fmt::print(out, "\nNo significant regressions\n");
+
+	return regressions || compared == 0 ? 1 : 0;
+}
+
+int run_bench(const BenchOptions &options, const Format format)
+{
+	if (options.cpu >= 0 && !pin_to_cpu(options.cpu))
+		fmt::print(stderr, "Warning: unable to pin to CPU {}\n", options.cpu);
+
+	const auto runs = options.runs;
+
+	std::unique_ptr<PerfCounters> counters;
+	if (options.counters)
+	{
+		counters = std::make_unique<PerfCounters>();
+
+		if (!counters->available())
+		{
+			fmt::print(stderr, "Warning: hardware performance counters are unavailable "
+							   "(see /proc/sys/kernel/perf_event_paranoid)\n");
+			counters.reset();
+		}
+	}
+
+	// Counter totals over the timed runs of each position, and its nodes over those runs
+	std::vector<std::tuple<std::string_view, PerfCounters::Values, double>> counts;
+
+	if (format == Format::Text && runs == 1)
+		fmt::print("{: <10} {: <6} {: <12} {: <12} {}\n", "Name", "Depth", "Nodes", "Time (ms)",
+				   "Nodes/sec");
+	else if (format == Format::Text)
+		fmt::print("{: <10} {: <6} {: <12} {: <12} {: <12} {: <8} {}\n", "Name", "Depth", "Nodes",
+				   "Median (ms)", "Min (ms)", "Stddev", "Nodes/sec");
+
+	// Times are in seconds; run_times[r] is the total time of run r
+	std::vector<double> run_times(runs);
+	std::vector<BenchResult> results;
+	Nodes total_nodes = 0;
+	double total_median = 0;
+
+	for (const auto &name_fen_depth : PredefinedFENs)
+	{
+		Board board;
+		if (const auto status = parse_fen(board, name_fen_depth.fen); status != 0)
+		{
+			fmt::print("Error: FEN parser returned non-zero code {} when parsing '{}' ({})\n",
+					   status, name_fen_depth.fen);
+			return 1;
+		}
+
+		for (unsigned i = 0; i < options.warmup; ++i)
+			perft(board, name_fen_depth.depth);
+
+		Nodes nodes = 0;
+		Estimate time, rate;
+		std::vector<double> times;
+		PerfCounters::Values count {};
+
+		for (unsigned r = 0; r < runs; ++r)
+		{
+			if (counters)
+				counters->start();
+
+			const auto t0 = Clock::now();
+			nodes = perft(board, name_fen_depth.depth);
+			const auto t1 = Clock::now();
+
+			if (counters)
+			{
+				const auto values = counters->stop();
+				for (std::size_t i = 0; i < values.size(); ++i)
+					count[i] += values[i];
+			}
+
+			const auto dt = std::chrono::duration<double>(t1 - t0).count();
+			times.push_back(dt);
+			time.add(dt);
+			rate.add(dt > 0 ? nodes / dt : 0.0);
+			run_times[r] += dt;
+		}
+
+		results.push_back({name_fen_depth.name, name_fen_depth.depth, nodes, rate});
+
+		if (counters)
+			counts.emplace_back(name_fen_depth.name, count, static_cast<double>(nodes) * runs);
+
+		const auto median_time = median(times);
+		const auto nps = median_time > 0 ? nodes / median_time : 0.0;
+
+		total_nodes += nodes;
+		total_median += median_time;
+
+		if (format != Format::Text)
+		{
+			print_record(format, {"bench", name_fen_depth.name, name_fen_depth.fen, "",
+								  name_fen_depth.depth, nodes,
+								  duration_cast<Microseconds>(
+									  std::chrono::duration<double>(median_time))});
+		}
+		else if (runs == 1)
+		{
+			fmt::print("{: <10} {: <6} {: <12} {: <12.0f} {:.0f}\n", name_fen_depth.name,
+					   name_fen_depth.depth, nodes, 1e3 * median_time, nps);
+		}
+		else
+		{
+			const auto stddev = std::sqrt(time.m2 / (runs - 1));
+			const auto min_time = *std::min_element(times.begin(), times.end());
+
+			fmt::print("{: <10} {: <6} {: <12} {: <12.2f} {: <12.2f} {: <8} {:.0f}\n",
+					   name_fen_depth.name, name_fen_depth.depth, nodes, 1e3 * median_time,
+					   1e3 * min_time, fmt::format("{:.2f}%", 100 * stddev / time.mean), nps);
+		}
+	}
+
+	Estimate rate;
+	for (const auto t : run_times)
+		rate.add(t > 0 ? total_nodes / t : 0.0);
+
+	results.push_back({"total", 0, total_nodes, rate});
+
+	if (format != Format::Text)
+	{
+		print_record(format, {"bench", "total", "", "", 0, total_nodes,
+							  duration_cast<Microseconds>(
+								  std::chrono::duration<double>(total_median))});
+	}
+	else if (runs == 1)
+	{
+		fmt::print("{: <10} {: <6} {: <12} {: <12.0f} {:.0f}\n", "total/avg", '-', total_nodes,
+				   1e3 * total_median, rate.mean);
+	}
+	else
+	{
+		fmt::print("{: <10} {: <6} {: <12} {: <12.2f} {: <12} {: <8} {:.0f}\n", "total/avg", '-',
+				   total_nodes, 1e3 * total_median, '-', '-', rate.mean);
+		fmt::print("Nodes/sec over {} runs: {:.0f} +/- {:.0f} ({:.2f}%, 95% confidence)\n", runs,
+				   rate.mean, rate.interval(student_t95(runs - 1)),
+				   100 * rate.interval(student_t95(runs - 1)) / rate.mean);
+	}
+
+	if (format == Format::Text && counters)
+	{
+		using P = PerfCounters;
+
+		fmt::print("\n{: <10} {: <6} {: <12} {: <14} {: <14} {: <14} {}\n", "Name", "IPC",
+				   "Instr/node", "Br-miss/node", "L1D-miss/node", "LLC-miss/node",
+				   "dTLB-miss/node");
+
+		// Unavailable counters are NaN, shown as '-'
+		const auto cell = [](double x, int width, int precision) {
+			return std::isnan(x) ? fmt::format("{: <{}}", '-', width)
+								 : fmt::format("{: <{}.{}f}", x, width, precision);
+		};
+
+		for (const auto &[name, count, nodes] : counts)
+		{
+			fmt::print("{: <10} {} {} {} {} {} {}\n", name,
+					   cell(count[P::Instructions] / count[P::Cycles], 6, 2),
+					   cell(count[P::Instructions] / nodes, 12, 1),
+					   cell(count[P::BranchMisses] / nodes, 14, 3),
+					   cell(count[P::L1DMisses] / nodes, 14, 3),
+					   cell(count[P::LLCMisses] / nodes, 14, 4),
+					   cell(count[P::DTLBMisses] / nodes, 1, 4));
+		}
+	}
+
+	auto status = 0;
+
+	if (!options.compare.empty())
+		status = compare_baseline(options.compare, results, options.threshold,
+								  format == Format::Text ? stdout : stderr);
+
+	if (!options.save_baseline.empty() && !save_baseline(options.save_baseline, results))
+	{
+		fmt::print(stderr, "Error: unable to write baseline '{}'\n", options.save_baseline);
+		status = 1;
+	}
+
+	return status;
+}
+
+// Runs the benchmark positions at 1, 2, 4, ... and max_threads threads, showing the speedup
+// and parallel efficiency over one thread, and the share of thread time spent idle (waiting
+// for the other threads' last root subtrees)
+int run_bench_scaling(const unsigned max_threads, const unsigned split, const Format format)
+{
+	std::vector<unsigned> thread_counts;
+	for (unsigned t = 1; t < max_threads; t *= 2)
+		thread_counts.push_back(t);
+
+	thread_counts.push_back(max_threads);
+
+	if (format == Format::Text)
+		fmt::print("{: <8} {: <12} {: <12} {: <14} {: <9} {: <11} {}\n", "Threads", "Nodes",
+				   "Time (ms)", "Nodes/sec", "Speedup", "Efficiency", "Idle");
+
+	double base_rate = 0;
+
+	for (const auto threads : thread_counts)
+	{
+		Nodes nodes = 0;
+		double time = 0;
+		std::atomic<double> busy {0};
+
+		for (const auto &name_fen_depth : PredefinedFENs)
+		{
+			Board board;
+			if (const auto status = parse_fen(board, name_fen_depth.fen); status != 0)
+			{
+				fmt::print("Error: FEN parser returned non-zero code {} when parsing '{}' ({})\n",
+						   status, name_fen_depth.fen);
+				return 1;
+			}
+
+			const auto t0 = Clock::now();
+			nodes += perft_parallel(board, name_fen_depth.depth, threads, split, &busy);
+			time += std::chrono::duration<double>(Clock::now() - t0).count();
+		}
+
+		const auto rate = time > 0 ? nodes / time : 0.0;
+		if (threads == 1)
+			base_rate = rate;
+
+		const auto speedup = base_rate > 0 ? rate / base_rate : 0.0;
+		const auto idle = util::max(time > 0 ? 1 - busy / (time * threads) : 0.0, 0.0);
+
+		if (format != Format::Text)
+		{
+			print_record(format, {"scaling", "total", "", "", 0, nodes,
+								  duration_cast<Microseconds>(std::chrono::duration<double>(time)),
+								  threads, "", speedup, speedup / threads, idle});
+			continue;
+		}
+
+		fmt::print("{: <8} {: <12} {: <12.0f} {: <14.0f} {: <9.2f} {: <11} {}\n", threads, nodes,
+				   1e3 * time, rate, speedup, fmt::format("{:.1f}%", 100 * speedup / threads),
+				   fmt::format("{:.1f}%", 100 * idle));
+	}
+
+	return 0;
+}
+
+// Prints a per-ply table of a perft's profile: the positions at each ply (the leaves at the
+// last), the branching factor to the next ply, how often the rarer paths were taken and, with
+// USE_PROFILE_TIMING, the cycles spent per position at that ply excluding deeper plies
+void print_profile(const Profile &profile, const Depth depth, const Nodes leaves)
+{
+	using P = Profile;
+
+	fmt::print("{: <5} {: <14} {: <10} {: <9} {: <9} {: <9} {: <12} {: <12} {: <12} {}\n", "Ply",
+			   "Positions", "Branching", "In check", "Double", "Pinned", "En passant", "Castling",
+			   "Promotions", ProfileTiming ? "Cycles/pos" : "");
+
+	const auto percent = [](double part, double whole) {
+		return fmt::format("{:.2f}%", whole > 0 ? 100 * part / whole : 0.0);
+	};
+
+	for (Depth ply = 0; ply < depth; ++ply)
+	{
+		const auto &c = profile.counts[depth - ply];
+		const double positions = c[P::Positions];
+		const double next = ply + 1 < depth ? profile.counts[depth - ply - 1][P::Positions]
+											: static_cast<double>(leaves);
+
+		auto cycles = static_cast<double>(c[P::Cycles]);
+		if (depth - ply > 1)
+			cycles -= profile.counts[depth - ply - 1][P::Cycles];
+
+		fmt::print("{: <5} {: <14} {: <10.2f} {: <9} {: <9} {: <9} {: <12} {: <12} {: <12} {}\n",
+				   ply, c[P::Positions], positions > 0 ? next / positions : 0.0,
+				   percent(c[P::InCheck], positions), percent(c[P::DoubleCheck], positions),
+				   percent(c[P::Pinned], positions), c[P::EnPassant], c[P::Castling],
+				   c[P::Promotion],
+				   ProfileTiming ? fmt::format("{:.1f}", positions > 0 ? cycles / positions : 0)
+								 : "");
+	}
+
+	fmt::print("{: <5} {}\n", depth, leaves);
+}
+
+// Parses an EPD perft field, "D<depth> <count>"
+inline bool parse_depth_count(std::string_view field, unsigned &depth, Nodes &count)
+{
+	const auto skip_space = [&] {
+		while (!field.empty() && std::isspace(static_cast<unsigned char>(field.front())))
+			field.remove_prefix(1);
+	};
+
+	const auto parse = [&](auto &value) {
+		skip_space();
+		const auto [end, ec] = std::from_chars(field.data(), field.data() + field.size(), value);
+		field.remove_prefix(end - field.data());
+
+		return ec == std::errc();
+	};
+
+	skip_space();
+	if (field.empty() || field.front() != 'D')
+		return false;
+
+	field.remove_prefix(1);
+
+	return parse(depth) && parse(count);
+}
+
+struct SuiteJob
+{
+	std::size_t line;
+	std::string fen;
+	Board board;
+	Depth depth;
+	Nodes expected, nodes = 0;
+};
+
+// Reads the (position, depth) jobs of an EPD perft suite, up to max_depth if non-zero.
+// Returns false, having printed the error, if the file can't be read or parsed.
+bool load_suite(const std::string &path, const Depth max_depth, std::vector<SuiteJob> &jobs,
+				std::size_t &positions)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+		fmt::print("Error: unable to open '{}'\n", path);
+		return false;
+	}
+
+	std::string line;
+	for (std::size_t n = 1; std::getline(file, line); ++n)
+	{
+		std::string_view fields = line;
+		auto fen = fields.substr(0, fields.find(';'));
+
+		if (fen.find_first_not_of(" \t\r") == std::string_view::npos)
+			continue;
+
+		fen = fen.substr(0, fen.find_last_not_of(" \t\r") + 1);
+
+		Board board;
+		if (const auto status = parse_fen(board, fen); status != 0)
+		{
+			fmt::print("Error: FEN parser returned non-zero code {} when parsing '{}' (line {})\n",
+					   status, fen, n);
+			return false;
+		}
+
+		++positions;
+
+		// Each remaining field is "Dn count"
+		for (auto pos = fields.find(';'); pos != std::string_view::npos;)
+		{
+			const auto next = fields.find(';', pos + 1);
+			const auto field = fields.substr(pos + 1, next - pos - 1);
+			pos = next;
+
+			unsigned depth;
+			Nodes expected;
+			if (!parse_depth_count(field, depth, expected))
+			{
+				fmt::print("Error: unable to parse '{}' (line {})\n", field, n);
+				return false;
+			}
+
+			if (depth > 255)
+			{
+				fmt::print("Error: depth {} is over 255 (line {})\n", depth, n);
+				return false;
+			}
+
+			if (max_depth == 0 || depth <= max_depth)
+				jobs.push_back({n, std::string(fen), board, static_cast<Depth>(depth), expected});
+		}
+	}
+
+	return true;
+}
+
+// Runs the (position, depth) jobs of an EPD perft suite across threads, longest first, and
+// reports the jobs whose counts don't match. Returns non-zero if any don't.
+int run_suite(const std::string &path, const Depth max_depth, const unsigned threads)
+{
+	std::vector<SuiteJob> jobs;
+	std::size_t positions = 0;
+
+	if (!load_suite(path, max_depth, jobs, positions))
+		return 1;
+
+	// Longest first, so no thread is left with a big job at the end
+	std::sort(jobs.begin(), jobs.end(),
+			  [](const SuiteJob &a, const SuiteJob &b) { return a.expected > b.expected; });
+
+	std::atomic<std::size_t> next {0};
+	std::vector<std::thread> workers;
+
+	const auto t0 = Clock::now();
+
+	for (unsigned i = 0; i < threads; ++i)
+	{
+		workers.emplace_back([&] {
+			for (auto j = next++; j < jobs.size(); j = next++)
+				jobs[j].nodes = perft(jobs[j].board, jobs[j].depth);
+		});
+	}
+
+	for (auto &worker : workers)
+		worker.join();
+
+	const auto t1 = Clock::now();
+	const auto dt = duration_cast<Microseconds>(t1 - t0);
+
+	std::sort(jobs.begin(), jobs.end(), [](const SuiteJob &a, const SuiteJob &b) {
+		return a.line != b.line ? a.line < b.line : a.depth < b.depth;
+	});
+
+	Nodes total_nodes = 0;
+	std::size_t mismatches = 0;
+
+	for (const auto &job : jobs)
+	{
+		total_nodes += job.nodes;
+
+		if (job.nodes != job.expected)
+		{
+			fmt::print("Mismatch: line {} depth {}: expected {}, got {} ({})\n", job.line,
+					   job.depth, job.expected, job.nodes, job.fen);
+			++mismatches;
+		}
+	}
+
+	fmt::print("{} positions, {} jobs, {} mismatches\n", positions, jobs.size(), mismatches);
+	fmt::print("{} nodes\n{} ms\n{:.0f} nodes/sec\n", total_nodes,
+			   duration_cast<Milliseconds>(dt).count(), (1e6 * total_nodes) / dt.count());
+
+	return mismatches != 0;
+}
+
+//
+// Random position corpus
+//  --generate plays random legal games from the start position and samples positions from
+//  them into strata by phase, material balance and check, which get equal shares of the
+//  corpus. Moves are picked with the seeded mt19937_64 alone (no distributions, whose output
+//  is implementation-defined), so a seed gives the same corpus everywhere. The corpus is an
+//  EPD perft suite, which --suite checks and --bench --corpus times.
+//
+
+constexpr std::array<std::string_view, 3> Phases {"opening", "middlegame", "endgame"};
+constexpr unsigned Strata = Phases.size() * 2 * 2;
+
+// The stratum of a position: its phase (by the number of pieces other than pawns and kings),
+// whether the sides' material differs and whether the side to move is in check
+unsigned stratum(const Board &board)
+{
+	const auto pieces = popcount(board.knights | board.bishops_queens | board.rooks_queens);
+	const auto phase = pieces >= 11 ? 0 : pieces >= 6 ? 1 : 2;
+
+	const auto material = [&](const Bitboard side) {
+		const auto queens = board.bishops_queens & board.rooks_queens;
+
+		return popcount(board.pawns & side) + 3 * popcount(board.knights & side) +
+			   3 * popcount(board.bishops_queens & ~queens & side) +
+			   5 * popcount(board.rooks_queens & ~queens & side) + 9 * popcount(queens & side);
+	};
+
+	const bool imbalanced = material(board.white_pieces) != material(board.black_pieces);
+	const bool in_check = board.side == White ? checks<White>(board) : checks<Black>(board);
+
+	return (phase * 2 + imbalanced) * 2 + in_check;
+}
+
+std::string stratum_name(const unsigned stratum)
+{
+	return fmt::format("{} {}{}", Phases[stratum / 4], stratum & 2 ? "imbalanced" : "balanced",
+					   stratum & 1 ? " check" : "");
+}
+
+int run_generate(const std::size_t count, const std::uint64_t seed, const Depth depth,
+				 const unsigned threads)
+{
+	std::mt19937_64 rng(seed);
+
+	std::array<std::vector<Board>, Strata> strata;
+	std::set<std::string> seen;
+	std::size_t sampled = 0;
+
+	const auto quota = [&](const unsigned i) { return count / Strata + (i < count % Strata); };
+
+	// Some strata are rare in random games (an opening position in check), so give up on
+	// filling them eventually
+	const auto max_games = 1000 + 100 * count;
+
+	for (std::size_t game = 0; game < max_games && sampled < count; ++game)
+	{
+		auto board = startpos();
+
+		for (unsigned ply = 0; ply < 400 && popcount(board.white_pieces | board.black_pieces) > 2;
+			 ++ply)
+		{
+			const auto moves = legal_moves(board);
+			if (moves.size == 0)
+				break;
+
+			// Take about one position in eight, so that samples from a game differ more
+			if (rng() % 8 == 0)
+			{
+				const auto i = stratum(board);
+
+				if (strata[i].size() < quota(i) && seen.insert(to_fen(board)).second)
+				{
+					strata[i].push_back(board);
+					++sampled;
+				}
+			}
+
+			make_move(board, moves[rng() % moves.size]);
+		}
+	}
+
+	std::vector<Board> boards;
+	for (unsigned i = 0; i < Strata; ++i)
+	{
+		if (strata[i].size() < quota(i))
+			fmt::print(stderr, "Warning: only {} of {} {} positions found\n", strata[i].size(),
+					   quota(i), stratum_name(i));
+
+		boards.insert(boards.end(), strata[i].begin(), strata[i].end());
+	}
+
+	// The perfts at each depth
+	std::vector<std::vector<Nodes>> counts;
+	for (Depth d = 1; d <= depth; ++d)
+		counts.push_back(perft_many(boards, d, threads));
+
+	for (std::size_t i = 0; i < boards.size(); ++i)
+	{
+		fmt::print("{}", to_fen(boards[i]));
+
+		for (Depth d = 1; d <= depth; ++d)
+			fmt::print(" ;D{} {}", d, counts[d - 1][i]);
+
+		fmt::print("\n");
+	}
+
+	return 0;
+}
+
+// Times the deepest perft of each position of an EPD suite (the median of 'runs' runs), and
+// shows the nodes/sec of each stratum of positions. Returns non-zero if any count is wrong.
+int run_bench_corpus(const std::string &path, const Depth max_depth, const unsigned runs,
+					 const Format format)
+{
+	std::vector<SuiteJob> jobs;
+	std::size_t positions = 0;
+
+	if (!load_suite(path, max_depth, jobs, positions))
+		return 1;
+
+	// Keep the deepest job of each line
+	std::map<std::size_t, SuiteJob> deepest;
+	for (const auto &job : jobs)
+	{
+		const auto it = deepest.find(job.line);
+		if (it == deepest.end() || it->second.depth < job.depth)
+			deepest.insert_or_assign(job.line, job);
+	}
+
+	struct Totals
+	{
+		std::size_t positions = 0;
+		Nodes nodes = 0;
+		double time = 0;
+	};
+
+	std::array<Totals, Strata> strata;
+	Totals total;
+	std::size_t mismatches = 0;
+
+	for (const auto &[line, job] : deepest)
+	{
+		std::vector<double> times;
+		Nodes nodes = 0;
+
+		for (unsigned r = 0; r < runs; ++r)
+		{
+			const auto t0 = Clock::now();
+			nodes = perft(job.board, job.depth);
+			times.push_back(std::chrono::duration<double>(Clock::now() - t0).count());
+		}
+
+		if (nodes != job.expected)
+		{
+			fmt::print(stderr, "Mismatch: line {} depth {}: expected {}, got {} ({})\n", line,
+					   job.depth, job.expected, nodes, job.fen);
+			++mismatches;
+		}
+
+		for (auto *totals : {&strata[stratum(job.board)], &total})
+		{
+			++totals->positions;
+			totals->nodes += nodes;
+			totals->time += median(times);
+		}
+	}
+
+	if (format == Format::Text)
+		fmt::print("{: <30} {: <10} {: <12} {: <12} {}\n", "Stratum", "Positions", "Nodes",
+				   "Time (ms)", "Nodes/sec");
+
+	const auto print = [&](const std::string &name, const Totals &totals) {
+		if (format != Format::Text)
+		{
+			print_record(format, {"corpus", name, "", "", 0, totals.nodes,
+								  duration_cast<Microseconds>(
+									  std::chrono::duration<double>(totals.time))});
+			return;
+		}
+
+		fmt::print("{: <30} {: <10} {: <12} {: <12.0f} {:.0f}\n", name, totals.positions,
+				   totals.nodes, 1e3 * totals.time,
+				   totals.time > 0 ? totals.nodes / totals.time : 0.0);
+	};
+
+	for (unsigned i = 0; i < Strata; ++i)
+		if (strata[i].positions)
+			print(stratum_name(i), strata[i]);
+
+	print("total", total);
+
+	return mismatches != 0;
+}
+
+// Runs a "fen depth" line of --batch input, giving its "fen depth nodes time" output line
+std::string batch_result(const std::string &line, const Format format)
+{
+	// The depth is the last field, everything before it is the FEN
+	const auto end = line.find_last_not_of(" \t\r") + 1;
+	const auto split = line.find_last_of(" \t", end - 1);
+
+	const auto fen = std::string_view(line).substr(0, split == std::string::npos ? 0 : split);
+	const auto depth_field = std::string_view(line).substr(split + 1, end - split - 1);
+
+	const auto error = [&](std::string_view message) {
+		if (format != Format::Text)
+			return format_record(format, {"batch", "", line.substr(0, end), "", 0, 0, {}, 1,
+										  message});
+
+		return fmt::format("{} error: {}\n", line.substr(0, end), message);
+	};
+
+	unsigned depth;
+	if (const auto [ptr, ec] =
+			std::from_chars(depth_field.data(), depth_field.data() + depth_field.size(), depth);
+		ec != std::errc() || ptr != depth_field.data() + depth_field.size())
+		return error("unable to parse depth");
+
+	if (depth > 255)
+		return error("depth must be at most 255");
+
+	Board board;
+	if (const auto status = parse_fen(board, fen); status != 0)
+		return error(fmt::format("FEN parser returned non-zero code {}", status));
+
+	const auto t0 = Clock::now();
+	const auto nodes = perft(board, depth);
+	const auto t1 = Clock::now();
+
+	if (format != Format::Text)
+		return format_record(format, {"batch", "", fen, "", depth, nodes,
+									  duration_cast<Microseconds>(t1 - t0)});
+
+	return fmt::format("{} {} {} {}\n", fen, depth, nodes,
+					   duration_cast<Microseconds>(t1 - t0).count());
+}
+
+// Reads "fen depth" lines from stdin and writes "fen depth nodes time" lines to stdout, with
+// the time in microseconds. Lines are processed by a pool of threads and written as they
+// finish (or in input order if 'ordered'), and the output is flushed whenever the workers
+// run out of input.
+int run_batch(const unsigned threads, const bool ordered, const Format format)
+{
+	// Lines read but not yet written, beyond which reading waits for the workers
+	const std::size_t max_pending = 64 * threads;
+
+	std::mutex mutex;
+	std::condition_variable input_ready, output_ready;
+
+	std::deque<std::pair<std::size_t, std::string>> input;
+	std::map<std::size_t, std::string> finished; // Results waiting for earlier lines, if ordered
+	std::size_t read = 0, written = 0;
+	bool eof = false;
+
+	std::string output;
+
+	// Called with the lock held
+	const auto write = [&](const std::size_t sequence, std::string result) {
+		if (ordered)
+		{
+			finished.emplace(sequence, std::move(result));
+
+			for (auto it = finished.begin(); it != finished.end() && it->first == written;
+				 it = finished.erase(it), ++written)
+				output += it->second;
+		}
+		else
+		{
+			output += result;
+			++written;
+		}
+
+		if (output.size() >= (1 << 16) || input.empty())
+		{
+			std::fwrite(output.data(), 1, output.size(), stdout);
+			std::fflush(stdout);
+			output.clear();
+		}
+
+		output_ready.notify_one();
+	};
+
+	const auto work = [&] {
+		std::unique_lock lock(mutex);
+
+		while (true)
+		{
+			input_ready.wait(lock, [&] { return !input.empty() || eof; });
+
+			if (input.empty())
+				return;
+
+			auto [sequence, line] = std::move(input.front());
+			input.pop_front();
+			lock.unlock();
+
+			auto result = batch_result(line, format);
+
+			lock.lock();
+			write(sequence, std::move(result));
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < threads; ++i)
+		workers.emplace_back(work);
+
+	std::string line;
+	while (std::getline(std::cin, line))
+	{
+		if (line.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+
+		std::unique_lock lock(mutex);
+		output_ready.wait(lock, [&] { return read - written < max_pending; });
+
+		input.emplace_back(read++, std::move(line));
+		input_ready.notify_one();
+	}
+
+	{
+		std::lock_guard lock(mutex);
+		eof = true;
+	}
+
+	input_ready.notify_all();
+
+	for (auto &worker : workers)
+		worker.join();
+
+	std::fwrite(output.data(), 1, output.size(), stdout);
+	std::fflush(stdout);
+
+	return 0;
+}
+
+//
+// Perft server
+//  Requests and responses are JSON objects, one per line. A request has a "depth", and
+//  optionally a "fen" (or predefined FEN name, startpos by default), "moves" (array of UCI
+//  moves), "divide" and "stats" flags and an "id", which is echoed back:
+//   {"id": 1, "fen": "kiwipete", "moves": ["e1g1"], "depth": 4, "divide": true}
+//  The response has the "nodes", the "divide" counts per root move and/or "stats" if asked
+//  for, and the latency in microseconds ("us"), or an "error" message.
+//  Each request is split into a task per root move, and all clients share one pool of
+//  workers which takes tasks from each client in turn.
+//
+
+// Worker threads taking tasks round-robin from each client's queue
+class WorkerPool
+{
+public:
+	explicit WorkerPool(const unsigned threads)
+	{
+		for (unsigned i = 0; i < threads; ++i)
+			workers.emplace_back([this] { work(); });
+	}
+
+	~WorkerPool()
+	{
+		{
+			std::lock_guard lock(mutex);
+			stopping = true;
+		}
+
+		ready.notify_all();
+
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	void submit(const std::size_t client, std::function<void()> task)
+	{
+		{
+			std::lock_guard lock(mutex);
+			queues[client].push_back(std::move(task));
+		}
+
+		ready.notify_one();
+	}
+
+private:
+	void work()
+	{
+		std::unique_lock lock(mutex);
+
+		while (true)
+		{
+			ready.wait(lock, [&] { return !queues.empty() || stopping; });
+
+			if (queues.empty())
+				return;
+
+			// The next client after the last one served
+			auto it = queues.upper_bound(turn);
+			if (it == queues.end())
+				it = queues.begin();
+
+			turn = it->first;
+			auto task = std::move(it->second.front());
+
+			it->second.pop_front();
+			if (it->second.empty())
+				queues.erase(it);
+
+			lock.unlock();
+			task();
+			lock.lock();
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::map<std::size_t, std::deque<std::function<void()>>> queues;
+	std::size_t turn = 0;
+	bool stopping = false;
+	std::vector<std::thread> workers;
+};
+
+struct ServeRequest
+{
+	std::string id = "null"; // Raw JSON value
+	std::string fen = PredefinedFENs[0].fen;
+	std::vector<std::string> moves;
+	unsigned depth = 0;
+	bool divide = false, stats = false;
+};
+
+// Parses the flat JSON object of a request. Returns an error message, or an empty string.
+std::string parse_request(std::string_view json, ServeRequest &request)
+{
+	std::size_t pos = 0;
+
+	const auto skip_space = [&] {
+		while (pos < json.size() && std::isspace(static_cast<unsigned char>(json[pos])))
+			++pos;
+	};
+
+	const auto expect = [&](const char c) {
+		skip_space();
+		return pos < json.size() && json[pos] == c ? (++pos, true) : false;
+	};
+
+	const auto parse_string = [&](std::string &out) {
+		if (!expect('"'))
+			return false;
+
+		for (out.clear(); pos < json.size() && json[pos] != '"'; ++pos)
+		{
+			if (json[pos] == '\\' && ++pos == json.size())
+				return false;
+
+			out += json[pos];
+		}
+
+		return expect('"');
+	};
+
+	// A number or literal, returned as-is
+	const auto parse_token = [&] {
+		skip_space();
+		const auto begin = pos;
+		while (pos < json.size() && (std::isalnum(static_cast<unsigned char>(json[pos])) ||
+									 json[pos] == '-' || json[pos] == '+' || json[pos] == '.'))
+			++pos;
+
+		return json.substr(begin, pos - begin);
+	};
+
+	const auto parse_bool = [&](bool &out) {
+		const auto token = parse_token();
+		out = token == "true";
+		return token == "true" || token == "false";
+	};
+
+	// -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+	const auto is_number = [](std::string_view token) {
+		std::size_t i = 0;
+		const auto digits = [&] {
+			const auto begin = i;
+			while (i < token.size() && std::isdigit(static_cast<unsigned char>(token[i])))
+				++i;
+			return i > begin;
+		};
+
+		if (i < token.size() && token[i] == '-')
+			++i;
+
+		if (i < token.size() && token[i] == '0')
+			++i;
+		else if (!digits())
+			return false;
+
+		if (i < token.size() && token[i] == '.' && (++i, !digits()))
+			return false;
+
+		if (i < token.size() && (token[i] == 'e' || token[i] == 'E'))
+		{
+			if (++i < token.size() && (token[i] == '+' || token[i] == '-'))
+				++i;
+
+			if (!digits())
+				return false;
+		}
+
+		return i == token.size();
+	};
+
+	if (!expect('{'))
+		return "expected an object";
+
+	if (expect('}'))
+		return "missing depth";
+
+	bool has_depth = false;
+
+	do
+	{
+		std::string key;
+		if (!parse_string(key) || !expect(':'))
+			return "expected a key";
+
+		if (key == "id")
+		{
+			// Echoed as-is in the response, so it has to be valid JSON by itself
+			skip_space();
+			const auto begin = pos;
+			std::string value;
+			if (pos < json.size() && json[pos] == '"')
+			{
+				if (!parse_string(value))
+					return "id should be a number, string or null";
+
+				const auto raw = json.substr(begin, pos - begin);
+				if (std::any_of(raw.begin(), raw.end(),
+								[](const char c) { return static_cast<unsigned char>(c) < 0x20; }))
+					return "id should be a number, string or null";
+			}
+			else if (const auto token = parse_token(); token != "null" && !is_number(token))
+				return "id should be a number, string or null";
+
+			request.id = json.substr(begin, pos - begin);
+		}
+		else if (key == "fen")
+		{
+			if (!parse_string(request.fen))
+				return "fen should be a string";
+		}
+		else if (key == "moves")
+		{
+			if (!expect('['))
+				return "moves should be an array of strings";
+
+			if (!expect(']'))
+			{
+				do
+				{
+					if (!parse_string(request.moves.emplace_back()))
+						return "moves should be an array of strings";
+				} while (expect(','));
+
+				if (!expect(']'))
+					return "moves should be an array of strings";
+			}
+		}
+		else if (key == "depth")
+		{
+			const auto token = parse_token();
+			const auto [end, ec] =
+				std::from_chars(token.data(), token.data() + token.size(), request.depth);
+
+			if (ec != std::errc() || end != token.data() + token.size() || request.depth > 255)
+				return "depth should be an integer up to 255";
+
+			has_depth = true;
+		}
+		else if (key == "divide" || key == "stats")
+		{
+			if (!parse_bool(key == "divide" ? request.divide : request.stats))
+				return key + " should be a boolean";
+		}
+		else
+			return "unknown key " + key;
+	} while (expect(','));
+
+	if (!expect('}'))
+		return "expected , or }";
+
+	return has_depth ? "" : "missing depth";
+}
+
+// Runs a request on the pool, as 'client', and returns the response
+std::string serve_request(WorkerPool &pool, const std::size_t client, const std::string &line)
+{
+	const auto t0 = Clock::now();
+
+	ServeRequest request;
+	const auto error = [&](std::string_view message) {
+		return fmt::format("{{\"id\":{},\"error\":\"{}\"}}\n", request.id, json_escape(message));
+	};
+
+	if (const auto message = parse_request(line, request); !message.empty())
+		return error(message);
+
+	for (const auto &name_fen_depth : PredefinedFENs)
+		if (name_fen_depth.name == request.fen)
+			request.fen = name_fen_depth.fen;
+
+	Board board;
+	if (const auto status = parse_fen(board, request.fen); status != 0)
+		return error(fmt::format("FEN parser returned non-zero code {}", status));
+
+	for (const auto &move : request.moves)
+		if (const auto status = push_legal_uci(board, move); status != 0)
+			return error(fmt::format("move parser returned non-zero code {} for {}", status, move));
+
+	// Stats at depth 1 classify the root moves themselves, so those can't be split
+	const auto depth = static_cast<Depth>(request.depth);
+	const bool split = depth > 1 || (depth == 1 && !request.stats);
+	const auto moves = split ? legal_moves(board) : MoveList {};
+	const auto tasks = split ? moves.size : 1;
+
+	std::vector<Stats> results(tasks);
+
+	std::mutex mutex;
+	std::condition_variable done;
+	std::size_t remaining = tasks;
+
+	for (std::size_t i = 0; i < tasks; ++i)
+	{
+		pool.submit(client, [&, i] {
+			Board child = board;
+			if (split)
+				make_move(child, moves[i]);
+
+			const auto child_depth = split ? depth - 1 : depth;
+
+			if (request.stats)
+				results[i] = perft<false, Stats>(child, child_depth);
+			else
+				results[i].nodes = perft(child, child_depth);
+
+			std::lock_guard lock(mutex);
+			if (--remaining == 0)
+				done.notify_one();
+		});
+	}
+
+	{
+		std::unique_lock lock(mutex);
+		done.wait(lock, [&] { return remaining == 0; });
+	}
+
+	Stats total {};
+	for (const auto &result : results)
+		total += result;
+
+	// Depth 0 is the root itself
+	if (depth == 0)
+		total.nodes = 1;
+
+	auto response = fmt::format("{{\"id\":{},\"nodes\":{}", request.id, total.nodes);
+
+	if (request.divide && split)
+	{
+		response += ",\"divide\":{";
+		for (std::size_t i = 0; i < tasks; ++i)
+			response += fmt::format("{}\"{}\":{}", i ? "," : "", moves[i], results[i].nodes);
+		response += "}";
+	}
+
+	if (request.stats)
+	{
+		response += fmt::format(
+			",\"stats\":{{\"captures\":{},\"en_passants\":{},\"castles\":{},\"promotions\":{},"
+			"\"checks\":{},\"discovery_checks\":{},\"double_checks\":{},\"checkmates\":{}}}",
+			total.captures, total.en_passants, total.castles, total.promotions, total.checks,
+			total.discovery_checks, total.double_checks, total.checkmates);
+	}
+
+	const auto us = duration_cast<Microseconds>(Clock::now() - t0).count();
+	fmt::print("client {}: depth {} nodes {} in {} us\n", client, request.depth, total.nodes, us);
+	std::fflush(stdout);
+
+	return response + fmt::format(",\"us\":{}}}\n", us);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+// Sends the whole of 'data', returning false if the connection failed
+bool send_all(const int connection, std::string_view data)
+{
+	while (!data.empty())
+	{
+		const auto n = send(connection, data.data(), data.size(), 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		data.remove_prefix(n);
+	}
+
+	return true;
+}
+
+// Longest request line a client may send; a longer one closes the connection
+constexpr std::size_t MaxRequestSize = 64 << 10;
+
+// Serves requests until the process is killed. Each client gets a thread reading its requests,
+// which are answered in order.
+int run_server(const std::string &path, const unsigned threads)
+{
+	sockaddr_un address {};
+	address.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		fmt::print("Error: socket path '{}' is too long\n", path);
+		return 1;
+	}
+
+	path.copy(address.sun_path, path.size());
+
+	// A socket left by an earlier server is replaced, but never any other kind of file
+	if (struct stat status; lstat(path.c_str(), &status) == 0)
+	{
+		if (!S_ISSOCK(status.st_mode))
+		{
+			fmt::print("Error: '{}' exists and isn't a socket\n", path);
+			return 1;
+		}
+
+		unlink(path.c_str());
+	}
+
+	const auto server = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (server < 0 || bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+		listen(server, SOMAXCONN) != 0)
+	{
+		fmt::print("Error: unable to listen on '{}'\n", path);
+		return 1;
+	}
+
+	// Clients hanging up shouldn't kill the server
+	std::signal(SIGPIPE, SIG_IGN);
+
+	fmt::print("Serving on {} with {} threads\n", path, threads);
+	std::fflush(stdout);
+
+	WorkerPool pool(threads);
+
+	for (std::size_t client = 1;; ++client)
+	{
+		const auto connection = accept(server, nullptr, nullptr);
+		if (connection < 0)
+			continue;
+
+		std::thread([&pool, client, connection] {
+			std::string buffer;
+			char chunk[4096];
+			bool connected = true;
+
+			for (ssize_t n; connected && (n = recv(connection, chunk, sizeof(chunk), 0)) > 0;)
+			{
+				buffer.append(chunk, n);
+
+				for (auto end = buffer.find('\n'); connected && end != std::string::npos;
+					 end = buffer.find('\n'))
+				{
+					const auto line = buffer.substr(0, end);
+					buffer.erase(0, end + 1);
+
+					if (line.find_first_not_of(" \t\r") == std::string::npos)
+						continue;
+
+					connected = send_all(connection, serve_request(pool, client, line));
+				}
+
+				if (connected && buffer.size() > MaxRequestSize)
+				{
+					send_all(connection, "{\"id\":null,\"error\":\"request too long\"}\n");
+					connected = false;
+				}
+			}
+
+			close(connection);
+		}).detach();
+	}
+}
+
+#else
+
+int run_server(const std::string &, const unsigned)
+{
+	fmt::print("Error: --serve needs UNIX domain sockets, which aren't supported here\n");
+	return 1;
+}
+
+#endif
+
+// A UCI front-end: "uci", "isready", "ucinewgame", "setoption name Threads value <n>",
+// "position [startpos | fen <fen>] [moves <moves>...]", "go perft <depth>", "d" and "quit",
+// with the divide output formatted like Stockfish's
+int run_uci(unsigned threads)
+{
+	Board board;
+	parse_fen(board, PredefinedFENs[0].fen);
+
+	std::string line;
+	while (std::getline(std::cin, line))
+	{
+		std::istringstream is(line);
+		std::string token;
+		is >> token;
+
+		if (token == "uci")
+		{
+			fmt::print("id name Perft\n");
+			fmt::print("id author Perft authors\n\n");
+			fmt::print("option name Threads type spin default 1 min 1 max {}\n",
+					   util::max(std::thread::hardware_concurrency(), 1u));
+			fmt::print("uciok\n");
+		}
+		else if (token == "isready")
+			fmt::print("readyok\n");
+		else if (token == "ucinewgame")
+			parse_fen(board, PredefinedFENs[0].fen);
+		else if (token == "setoption")
+		{
+			std::string name, value;
+			is >> token >> name >> token >> value;
+
+			if (name == "Threads")
+			{
+				const auto n = static_cast<unsigned>(std::strtoul(value.c_str(), nullptr, 10));
+				threads = util::clamp(n, 1u, util::max(std::thread::hardware_concurrency(), 1u));
+			}
+		}
+		else if (token == "position")
+		{
+			std::string fen;
+
+			is >> token;
+			if (token == "startpos")
+			{
+				fen = PredefinedFENs[0].fen;
+				is >> token;
+			}
+			else if (token == "fen")
+			{
+				while (is >> token && token != "moves")
+					fen += token + " ";
+			}
+			else
+				continue;
+
+			Board new_board;
+			if (const auto status = parse_fen(new_board, fen); status != 0)
+			{
+				fmt::print("info string FEN parser returned non-zero code {}\n", status);
+				std::fflush(stdout);
+				continue;
+			}
+
+			// 'token' is "moves" if there are any. The position only changes if every move is
+			// legal.
+			bool legal = true;
+			while (legal && is >> token)
+			{
+				if (const auto status = push_legal_uci(new_board, token); status != 0)
+				{
+					fmt::print("info string move parser returned non-zero code {} for {}\n", status,
+							   token);
+					std::fflush(stdout);
+					legal = false;
+				}
+			}
+
+			if (legal)
+				board = new_board;
+		}
+		else if (token == "go")
+		{
+			unsigned depth = 0;
+			if (!(is >> token) || token != "perft" || !(is >> depth) || depth == 0)
+			{
+				fmt::print("info string only \"go perft <depth>\" is supported\n");
+				std::fflush(stdout);
+				continue;
+			}
+
+			if (depth > 255)
+			{
+				fmt::print("info string depth should be at most 255\n");
+				std::fflush(stdout);
+				continue;
+			}
+
+			const auto moves = legal_moves(board);
+			const auto nodes = perft_root_moves(board, moves, depth, threads);
+
+			Nodes total = 0;
+			for (std::size_t i = 0; i < moves.size; ++i)
+			{
+				fmt::print("{}: {}\n", moves[i], nodes[i]);
+				total += nodes[i];
+			}
+
+			fmt::print("\nNodes searched: {}\n\n", total);
+		}
+		else if (token == "d")
+			fmt::print("{}\n", to_string(board));
+		else if (token == "quit")
+			break;
+
+		std::fflush(stdout);
+	}
+
+	return 0;
+}
+
+//
+// Verification against a reference UCI engine
+//  The reference engine is asked for a "go perft" divide of each position. If the root moves
+//  differ, that is the first difference; otherwise the per-move counts are compared, and the
+//  search recurses into the first move whose count differs until the depth runs out. Each
+//  level's subtrees are counted by several engine processes in parallel.
+//
+
+#if defined(__unix__) || defined(__APPLE__)
+
+// A UCI engine running in a child process, talked to over pipes
+class UciEngine
+{
+public:
+	explicit UciEngine(const std::string &command)
+	{
+		// Close-on-exec, so that engines started later don't inherit this one's pipes (which
+		// would then never reach EOF if this engine exited). dup2() clears the flag on the
+		// child's stdin and stdout.
+		const auto cloexec_pipe = [](int fds[2]) {
+			return pipe(fds) == 0 && fcntl(fds[0], F_SETFD, FD_CLOEXEC) == 0 &&
+				   fcntl(fds[1], F_SETFD, FD_CLOEXEC) == 0;
+		};
+
+		int to_engine[2], from_engine[2];
+		if (!cloexec_pipe(to_engine) || !cloexec_pipe(from_engine))
+			throw std::runtime_error("unable to create pipes");
+
+		pid = fork();
+		if (pid < 0)
+			throw std::runtime_error("unable to fork");
+
+		if (pid == 0)
+		{
+			dup2(to_engine[0], STDIN_FILENO);
+			dup2(from_engine[1], STDOUT_FILENO);
+			close(to_engine[0]);
+			close(to_engine[1]);
+			close(from_engine[0]);
+			close(from_engine[1]);
+
+			execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+			_exit(127);
+		}
+
+		close(to_engine[0]);
+		close(from_engine[1]);
+		in = fdopen(to_engine[1], "w");
+		out = fdopen(from_engine[0], "r");
+
+		send("uci");
+		while (read_line() != "uciok")
+			;
+	}
+
+	~UciEngine()
+	{
+		send("quit");
+		std::fclose(in);
+		std::fclose(out);
+		waitpid(pid, nullptr, 0);
+	}
+
+	UciEngine(const UciEngine &) = delete;
+	UciEngine &operator=(const UciEngine &) = delete;
+
+	// The count for each root move after 'moves' from 'fen', sorted by move
+	std::map<std::string, Nodes> divide(const std::string &fen,
+										const std::vector<std::string> &moves, const Depth depth)
+	{
+		std::string position = "position fen " + fen;
+		if (!moves.empty())
+			position += " moves";
+
+		for (const auto &move : moves)
+			position += " " + move;
+
+		send(position);
+		send(fmt::format("go perft {}", depth));
+
+		std::map<std::string, Nodes> counts;
+
+		for (auto line = read_line(); line.rfind("Nodes searched", 0) != 0; line = read_line())
+		{
+			const auto colon = line.find(": ");
+			if (colon == std::string::npos || colon < 4 || colon > 5)
+				continue;
+
+			Nodes nodes;
+			const auto begin = line.data() + colon + 2, end = line.data() + line.size();
+			if (const auto [ptr, ec] = std::from_chars(begin, end, nodes); ec == std::errc())
+				counts[line.substr(0, colon)] = nodes;
+		}
+
+		return counts;
+	}
+
+	// The perft after 'moves' from 'fen'
+	Nodes perft(const std::string &fen, const std::vector<std::string> &moves, const Depth depth)
+	{
+		Nodes total = 0;
+		for (const auto &[move, nodes] : divide(fen, moves, depth))
+			total += nodes;
+
+		return total;
+	}
+
+private:
+	void send(const std::string &line)
+	{
+		fmt::print(in, "{}\n", line);
+		std::fflush(in);
+	}
+
+	std::string read_line()
+	{
+		std::string line;
+
+		for (int c; (c = std::fgetc(out)) != '\n';)
+		{
+			if (c == EOF)
+				throw std::runtime_error("reference engine exited");
+
+			if (c != '\r')
+				line += static_cast<char>(c);
+		}
+
+		return line;
+	}
+
+	pid_t pid;
+	std::FILE *in, *out;
+};
+
+int run_verify(const std::string &engine, const std::string &fen,
+			   const std::vector<std::string> &moves, const Depth depth, const unsigned threads)
+{
+	// A dying engine shouldn't take us with it
+	std::signal(SIGPIPE, SIG_IGN);
+
+	try
+	{
+		std::vector<std::unique_ptr<UciEngine>> engines;
+		for (unsigned i = 0; i < threads; ++i)
+			engines.push_back(std::make_unique<UciEngine>(engine));
+
+		Board board;
+		parse_fen(board, fen);
+		for (const auto &move : moves)
+			parse_and_push_uci(board, move);
+
+		auto path = moves;
+
+		for (Depth d = depth; d > 0; --d)
+		{
+			const auto our_moves = legal_moves(board);
+			const auto our_counts = perft_root_moves(board, our_moves, d, threads);
+
+			std::map<std::string, std::pair<Nodes, Board>> ours;
+			for (std::size_t i = 0; i < our_moves.size; ++i)
+			{
+				Board child = board;
+				make_move(child, our_moves[i]);
+				ours[fmt::format("{}", our_moves[i])] = {our_counts[i], child};
+			}
+
+			// Compare the root moves, then count the subtrees in parallel
+			auto theirs = engines[0]->divide(fen, path, 1);
+
+			std::vector<std::string> only_ours, only_theirs;
+			for (const auto &[move, unused] : ours)
+				if (!theirs.count(move))
+					only_ours.push_back(move);
+
+			for (const auto &[move, unused] : theirs)
+				if (!ours.count(move))
+					only_theirs.push_back(move);
+
+			const auto position = fmt::format("position fen {}{}{}", fen,
+											  path.empty() ? "" : " moves ", fmt::join(path, " "));
+
+			if (!only_ours.empty() || !only_theirs.empty())
+			{
+				fmt::print("Root moves differ at depth {} ({})\n", d, position);
+				fmt::print(" only generated by us:        {}\n", fmt::join(only_ours, " "));
+				fmt::print(" only generated by reference: {}\n", fmt::join(only_theirs, " "));
+				return 1;
+			}
+
+			if (d > 1)
+			{
+				std::vector<std::string> keys;
+				for (const auto &[move, unused] : theirs)
+					keys.push_back(move);
+
+				std::atomic<std::size_t> next {0};
+				std::vector<std::thread> workers;
+
+				for (auto &engine : engines)
+				{
+					workers.emplace_back([&, e = engine.get()] {
+						for (auto j = next++; j < keys.size(); j = next++)
+						{
+							auto child_path = path;
+							child_path.push_back(keys[j]);
+							theirs.at(keys[j]) = e->perft(fen, child_path, d - 1);
+						}
+					});
+				}
+
+				for (auto &worker : workers)
+					worker.join();
+			}
+
+			const auto mismatch = std::find_if(ours.begin(), ours.end(), [&](const auto &entry) {
+				return entry.second.first != theirs.at(entry.first);
+			});
+
+			if (mismatch == ours.end())
+			{
+				if (d == depth)
+					fmt::print("OK: perft({}) matches the reference\n", depth);
+				else
+					fmt::print("Counts match again at depth {} ({}), so the difference is in "
+							   "the reference's divide output\n", d, position);
+
+				return d == depth ? 0 : 1;
+			}
+
+			fmt::print("Depth {}: {} gives {} (reference {})\n", d, mismatch->first,
+					   mismatch->second.first, theirs.at(mismatch->first));
+
+			path.push_back(mismatch->first);
+			board = mismatch->second.second;
+		}
+	}
+	catch (const std::exception &e)
+	{
+		fmt::print("Error: {}\n", e.what());
+		return 1;
+	}
+
+	return 1;
+}
+
+#else
+
+int run_verify(const std::string &, const std::string &, const std::vector<std::string> &,
+			   const Depth, const unsigned)
+{
+	fmt::print("Error: --verify needs POSIX pipes, which aren't supported here\n");
+	return 1;
+}
+
+#endif
+
+std::string_view slider_backend()
+{
+#if defined(USE_KOGGE)
+	return "Kogge-Stone";
+#elif defined(USE_FANCY)
+	return "fancy magic bitboards";
+#elif defined(USE_PEXT)
+	return "PEXT bitboards";
+#elif defined(USE_PDEP)
+	return "PEXT+PDEP bitboards";
+#else
+	return "unknown";
+#endif
+}
+
+std::string_view fill_backend()
+{
+#if defined(USE_AVX512_FILL)
+	return "AVX-512 Kogge-Stone";
+#elif defined(USE_AVX2_FILL)
+	return "AVX2 Kogge-Stone";
+#else
+	return "Kogge-Stone";
+#endif
+}
+
+// Space-separated build options, as in compiler_info()
+std::string build_flags()
+{
+	std::string out;
+
+#if !defined(NDEBUG)
+	out += "Debug ";
+#endif
+
+	if constexpr (HasLsbIntrinsics)
+		out += "LSB ";
+
+	if constexpr (HasPopcntIntrinsics)
+		out += "POPCNT ";
+
+	if constexpr (HasBMI2)
+		out += "BMI2 ";
+
+	if (!out.empty())
+		out.pop_back();
+
+	return out;
+}
+
+std::string compiler_info()
 {
 	std::string out;
 
@@ -217,7 +2861,7 @@ inline std::string compiler_info()
 #elif defined(_WIN64)
 	out += "Windows\n";
 #elif defined(__APPLE__)
-	out += "Apple\n"
+	out += "Apple\n";
 #elif defined(__MINGW64__)
 	out += "MinGW\n";
 #elif defined(__CYGWIN__)
@@ -253,19 +2897,8 @@ inline std::string compiler_info()
 	if constexpr (HasBMI2)
 		out += "BMI2 intrinsics\n";
 
-	out += "Move generation: ";
-
-#if defined(USE_KOGGE)
-	out += "Kogge-Stone\n";
-#elif defined(USE_FANCY)
-	out += "fancy magic bitboards\n";
-#elif defined(USE_PEXT)
-	out += "PEXT bitboards\n";
-#elif defined(USE_PDEP)
-	out += "PEXT+PDEP bitboards\n";
-#else
-	out += "unknown\n";
-#endif
+	out += fmt::format("Move generation: {}\n", slider_backend());
+	out += fmt::format("Setwise sliding attacks: {}\n", fill_backend());
 
 	return out;
 }
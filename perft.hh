@@ -27,19 +27,51 @@
 //#define USE_PEXT
 #define USE_PDEP
 
+// Vectorised Kogge-Stone fills for setwise sliding attacks (used by unsafe_squares)
+// (chosen from the target below unless one is defined here, the scalar fills are used otherwise)
+
+//#define USE_AVX2_FILL	// 4 directions per 256-bit vector
+//#define USE_AVX512_FILL // 8 directions per 512-bit vector
+//#define USE_SCALAR_FILL // Never vectorise the fills
+
+// Instrumentation of the perft functions (slows them down, see perft --profile)
+
+//#define USE_PROFILE		 // Count positions and generator paths per ply
+//#define USE_PROFILE_TIMING // Also time each ply with rdtsc (needs USE_PROFILE)
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#if !defined(USE_AVX2_FILL) && !defined(USE_AVX512_FILL) && !defined(USE_SCALAR_FILL)
+#	if defined(__AVX512F__)
+#		define USE_AVX512_FILL
+#	elif defined(__AVX2__)
+#		define USE_AVX2_FILL
+#	endif
+#endif
+
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <charconv>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <queue>
+#include <random>
+#include <stdexcept>
 #include <string>
 #include <thread>
+#include <vector>
 #include <type_traits>
+#include <utility>
 
 #define FMT_HEADER_ONLY
 #include "fmt/format.h"
 
-#if defined(USE_BMI2)
+#if defined(USE_BMI2) || defined(USE_AVX2_FILL) || defined(USE_AVX512_FILL)
 #	include <immintrin.h>
 #endif
 
@@ -56,6 +88,18 @@
 #	endif
 #endif
 
+#if defined(USE_PROFILE)
+#	include <mutex>
+#endif
+
+#if defined(USE_PROFILE_TIMING)
+#	if defined(_MSC_VER)
+#		include <intrin.h>
+#	else
+#		include <x86intrin.h>
+#	endif
+#endif
+
 #define ASSERT(cond) ((void)0)
 
 //
@@ -1055,6 +1099,111 @@ template <> constexpr Bitboard attacks_from<Queen>(Bitboard pieces, Bitboard occ
 	return attacks_from<Bishop>(pieces, occ) | attacks_from<Rook>(pieces, occ);
 }
 
+//
+// Vectorised Kogge-Stone occluded fills.
+//  Each 64-bit lane handles one direction. Left and right shifts are both
+//  evaluated per lane: a shift count of 64 zeroes the unused one.
+//
+
+#if defined(USE_AVX2_FILL)
+constexpr bool HasVectorFill = true;
+
+inline __m256i fill_lanes(__m256i gen, __m256i pro, const __m256i left, const __m256i right)
+{
+	const auto step = [&](const __m256i x, const int n) {
+		const auto l = _mm256_sllv_epi64(x, _mm256_slli_epi64(left, n));
+		const auto r = _mm256_srlv_epi64(x, _mm256_slli_epi64(right, n));
+		return _mm256_or_si256(l, r);
+	};
+
+	gen = _mm256_or_si256(gen, _mm256_and_si256(step(gen, 0), pro));
+	pro = _mm256_and_si256(pro, step(pro, 0));
+	gen = _mm256_or_si256(gen, _mm256_and_si256(step(gen, 1), pro));
+	pro = _mm256_and_si256(pro, step(pro, 1));
+	gen = _mm256_or_si256(gen, _mm256_and_si256(step(gen, 2), pro));
+
+	return step(gen, 0);
+}
+
+// Determines attacks from several bishops and rooks at once, with occupancy
+inline Bitboard slider_attacks(const Bitboard bishops, const Bitboard rooks, const Bitboard occ)
+{
+	// Directions: North, East, South, West / NorthEast, SouthEast, SouthWest, NorthWest
+	// Left shifts of 8, 1, 9 and 7; right shifts of 8, 1, 7 and 9. 0xff is out of range.
+	const auto rook_left = _mm256_setr_epi64x(8, 1, 0xff, 0xff);
+	const auto rook_right = _mm256_setr_epi64x(0xff, 0xff, 8, 1);
+	const auto bishop_left = _mm256_setr_epi64x(9, 0xff, 0xff, 7);
+	const auto bishop_right = _mm256_setr_epi64x(0xff, 7, 9, 0xff);
+
+	const auto rook_wrap = _mm256_setr_epi64x(AllBB, ~FileABB, AllBB, ~FileHBB);
+	const auto bishop_wrap = _mm256_setr_epi64x(~FileABB, ~FileABB, ~FileHBB, ~FileHBB);
+
+	const auto empty = _mm256_set1_epi64x(~occ);
+
+	const auto r = _mm256_and_si256(
+		fill_lanes(_mm256_set1_epi64x(rooks), _mm256_and_si256(empty, rook_wrap), rook_left,
+				   rook_right),
+		rook_wrap);
+	const auto b = _mm256_and_si256(
+		fill_lanes(_mm256_set1_epi64x(bishops), _mm256_and_si256(empty, bishop_wrap), bishop_left,
+				   bishop_right),
+		bishop_wrap);
+
+	auto x = _mm256_or_si256(r, b);
+	auto y = _mm_or_si128(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+	return _mm_cvtsi128_si64(y) | _mm_extract_epi64(y, 1);
+}
+#elif defined(USE_AVX512_FILL)
+constexpr bool HasVectorFill = true;
+
+inline __m512i fill_lanes(__m512i gen, __m512i pro, const __m512i left, const __m512i right)
+{
+	// The zero-masked shifts (with all lanes kept) avoid GCC's -Wuninitialized false positives
+	// on the _mm512_undefined source operand of the unmasked ones
+	const auto step = [&](const __m512i x, const int n) {
+		const auto l = _mm512_maskz_sllv_epi64(0xff, x, _mm512_slli_epi64(left, n));
+		const auto r = _mm512_maskz_srlv_epi64(0xff, x, _mm512_slli_epi64(right, n));
+		return _mm512_or_si512(l, r);
+	};
+
+	gen = _mm512_or_si512(gen, _mm512_and_si512(step(gen, 0), pro));
+	pro = _mm512_and_si512(pro, step(pro, 0));
+	gen = _mm512_or_si512(gen, _mm512_and_si512(step(gen, 1), pro));
+	pro = _mm512_and_si512(pro, step(pro, 1));
+	gen = _mm512_or_si512(gen, _mm512_and_si512(step(gen, 2), pro));
+
+	return step(gen, 0);
+}
+
+// Determines attacks from several bishops and rooks at once, with occupancy
+inline Bitboard slider_attacks(const Bitboard bishops, const Bitboard rooks, const Bitboard occ)
+{
+	// Directions: North, East, South, West, NorthEast, SouthEast, SouthWest, NorthWest
+	// Left shifts of 8, 1, 9 and 7; right shifts of 8, 1, 7 and 9. 0xff is out of range.
+	const auto left = _mm512_setr_epi64(8, 1, 0xff, 0xff, 9, 0xff, 0xff, 7);
+	const auto right = _mm512_setr_epi64(0xff, 0xff, 8, 1, 0xff, 7, 9, 0xff);
+	const auto wrap = _mm512_setr_epi64(AllBB, ~FileABB, AllBB, ~FileHBB, ~FileABB, ~FileABB,
+										~FileHBB, ~FileHBB);
+
+	const auto gen = _mm512_mask_set1_epi64(_mm512_set1_epi64(rooks), 0xf0, bishops);
+	const auto pro = _mm512_and_si512(_mm512_set1_epi64(~occ), wrap);
+
+	const auto x = _mm512_and_si512(fill_lanes(gen, pro, left, right), wrap);
+	const auto y = _mm256_or_si256(_mm512_maskz_extracti64x4_epi64(0xf, x, 0),
+								   _mm512_maskz_extracti64x4_epi64(0xf, x, 1));
+	const auto z = _mm_or_si128(_mm256_castsi256_si128(y), _mm256_extracti128_si256(y, 1));
+	return _mm_cvtsi128_si64(z) | _mm_extract_epi64(z, 1);
+}
+#else
+constexpr bool HasVectorFill = false;
+
+// Determines attacks from several bishops and rooks at once, with occupancy
+constexpr Bitboard slider_attacks(const Bitboard bishops, const Bitboard rooks, const Bitboard occ)
+{
+	return attacks_from<Bishop>(bishops, occ) | attacks_from<Rook>(rooks, occ);
+}
+#endif
+
 //
 // Bitboards: part 3
 // Line between / line connecting
@@ -1136,6 +1285,25 @@ constexpr bool aligned(const Square a, const Square b, const Square c)
 	return line_connecting(a, b) & c;
 }
 
+template <Direction D> constexpr array_t<Bitboard, Squares> make_line_through_lut()
+{
+	array_t<Bitboard, Squares> lut {};
+
+	for (auto sq = Square::A1; sq <= Square::H8; ++sq)
+		lut[to_int(sq)] = ray_attacks<D, Direction(-D)>(square_bb(sq)) | sq;
+
+	return lut;
+}
+
+template <Direction D> static constexpr auto LineThroughBB = make_line_through_lut<D>();
+
+// Full line through a square in direction D (and its opposite), including the square itself
+template <Direction D> constexpr Bitboard line_through(const Square sq)
+{
+	ASSERT(is_valid(sq));
+	return LineThroughBB<D>[to_int(sq)];
+}
+
 //
 // Bitboards, part 4
 //  Attack generation using Kogge-Stone/Fancy magic/PEXT/PEXT+PDEP
@@ -1601,39 +1769,42 @@ inline int parse_fen(Board &board, std::string_view fen)
 	return 0;
 }
 
+// The FEN character of the piece on sq, or 0 for an empty square
+inline char piece_char(const Board &board, const Square sq)
+{
+	if (((board.white_pieces | board.black_pieces) & sq) == 0)
+		return 0;
+
+	char c;
+
+	if (sq & board.pawns)
+		c = 'p';
+	else if (sq & board.knights)
+		c = 'n';
+	else if (sq & board.bishops_queens & board.rooks_queens)
+		c = 'q';
+	else if (sq & board.bishops_queens)
+		c = 'b';
+	else if (sq & board.rooks_queens)
+		c = 'r';
+	else
+		c = 'k';
+
+	return sq & board.white_pieces ? char(std::toupper(c)) : c;
+}
+
 inline std::string to_string(const Board &board)
 {
 	std::string s = "/---------------\\\n";
 
-	const auto occ = board.white_pieces | board.black_pieces;
-
 	for (auto rank = Rank::Eight; is_valid(rank); --rank)
 	{
 		for (auto file = File::A; is_valid(file); ++file)
 		{
 			s += '|';
-			const auto sq = make_square(file, rank);
-			if ((occ & sq) == 0)
-				s += '-';
-			else
-			{
-				char c;
-
-				if (sq & board.pawns)
-					c = 'p';
-				else if (sq & board.knights)
-					c = 'n';
-				else if (sq & board.bishops_queens & board.rooks_queens)
-					c = 'q';
-				else if (sq & board.bishops_queens)
-					c = 'b';
-				else if (sq & board.rooks_queens)
-					c = 'r';
-				else
-					c = 'k';
-
-				s += sq & board.white_pieces ? char(std::toupper(c)) : c;
-			}
+
+			const auto c = piece_char(board, make_square(file, rank));
+			s += c ? c : '-';
 		}
 		s += "|\n";
 	}
@@ -1646,6 +1817,55 @@ inline std::string to_string(const Board &board)
 	return s;
 }
 
+// The FEN of a board, without the move counters (like parse_fen's input)
+inline std::string to_fen(const Board &board)
+{
+	std::string fen;
+
+	for (auto rank = Rank::Eight; is_valid(rank); --rank)
+	{
+		int empty = 0;
+
+		for (auto file = File::A; is_valid(file); ++file)
+		{
+			if (const auto c = piece_char(board, make_square(file, rank)); c == 0)
+				++empty;
+			else
+			{
+				if (empty)
+					fen += char('0' + empty);
+
+				fen += c;
+				empty = 0;
+			}
+		}
+
+		if (empty)
+			fen += char('0' + empty);
+
+		if (rank != Rank::One)
+			fen += '/';
+	}
+
+	fen += board.side == White ? " w " : " b ";
+
+	const auto rights = board.castling_rights.all;
+	if (rights & WhiteShortCastling.all)
+		fen += 'K';
+	if (rights & WhiteLongCastling.all)
+		fen += 'Q';
+	if (rights & BlackShortCastling.all)
+		fen += 'k';
+	if (rights & BlackLongCastling.all)
+		fen += 'q';
+	if (!rights)
+		fen += '-';
+
+	fen += is_valid(board.en_passant) ? fmt::format(" {}", board.en_passant) : " -";
+
+	return fen;
+}
+
 constexpr Board startpos()
 {
 	Board board;
@@ -1668,20 +1888,66 @@ constexpr Board startpos()
 	return board;
 }
 
-template <Colour Us> constexpr Bitboard checks(const Board &board)
+//
+// Material signatures
+//  Which piece types are on the board, for either side. Move generation is
+//  instantiated per signature so that absent piece types cost nothing.
+//
+
+using Material = std::uint8_t;
+
+constexpr Material NoMaterial = 0;
+constexpr Material PawnMaterial = 1u << 0u;
+constexpr Material KnightMaterial = 1u << 1u;
+constexpr Material DiagonalMaterial = 1u << 2u;	  // Bishops and queens
+constexpr Material OrthogonalMaterial = 1u << 3u; // Rooks and queens
+constexpr Material AllMaterial = 0b1111;
+
+constexpr auto MaterialSignatures = AllMaterial + 1;
+
+constexpr Material material(const Board &board)
+{
+	return (board.pawns ? PawnMaterial : NoMaterial) |
+		   (board.knights ? KnightMaterial : NoMaterial) |
+		   (board.bishops_queens ? DiagonalMaterial : NoMaterial) |
+		   (board.rooks_queens ? OrthogonalMaterial : NoMaterial);
+}
+
+// Material added to the board by a promotion
+constexpr Material promotion_material(const PieceType promotion)
+{
+	return promotion == Knight	 ? KnightMaterial
+		   : promotion == Bishop ? DiagonalMaterial
+		   : promotion == Rook	 ? OrthogonalMaterial
+		   : promotion == Queen	 ? DiagonalMaterial | OrthogonalMaterial
+								 : NoMaterial;
+}
+
+template <Colour Us, Material M = AllMaterial> constexpr Bitboard checks(const Board &board)
 {
 	const auto ksq = Us == White ? board.white_king : board.black_king;
 	const auto their_pieces = Us == White ? board.black_pieces : board.white_pieces;
 
 	const auto occ = board.white_pieces | board.black_pieces;
 
-	return ((attacks_from<Bishop>(ksq, occ) & board.bishops_queens) |
-			(attacks_from<Rook>(ksq, occ) & board.rooks_queens) |
-			(attacks_from<Knight>(ksq) & board.knights) | (pawn_attacks(Us, ksq) & board.pawns)) &
-		   their_pieces;
+	Bitboard checkers = 0;
+
+	if (M & DiagonalMaterial)
+		checkers |= attacks_from<Bishop>(ksq, occ) & board.bishops_queens;
+
+	if (M & OrthogonalMaterial)
+		checkers |= attacks_from<Rook>(ksq, occ) & board.rooks_queens;
+
+	if (M & KnightMaterial)
+		checkers |= attacks_from<Knight>(ksq) & board.knights;
+
+	if (M & PawnMaterial)
+		checkers |= pawn_attacks(Us, ksq) & board.pawns;
+
+	return checkers & their_pieces;
 }
 
-template <Colour Us> constexpr Bitboard unsafe_squares(const Board &board)
+template <Colour Us, Material M = AllMaterial> inline Bitboard unsafe_squares(const Board &board)
 {
 	constexpr auto Them = ~Us;
 	const auto ksq = Us == White ? board.white_king : board.black_king;
@@ -1690,22 +1956,42 @@ template <Colour Us> constexpr Bitboard unsafe_squares(const Board &board)
 
 	const auto occ = (board.white_pieces | board.black_pieces) ^ ksq;
 
-	return attacks_from<Bishop>(board.bishops_queens & their_pieces, occ) |
-		   attacks_from<Rook>(board.rooks_queens & their_pieces, occ) |
-		   attacks_from<Knight>(board.knights & their_pieces) | attacks_from<King>(eksq) |
-		   pawn_attacks<Them>(board.pawns & their_pieces);
+	auto unsafe = attacks_from<King>(eksq);
+
+	if ((M & DiagonalMaterial) && (M & OrthogonalMaterial))
+		unsafe |= slider_attacks(board.bishops_queens & their_pieces,
+								 board.rooks_queens & their_pieces, occ);
+	else if (M & DiagonalMaterial)
+		unsafe |= attacks_from<Bishop>(board.bishops_queens & their_pieces, occ);
+	else if (M & OrthogonalMaterial)
+		unsafe |= attacks_from<Rook>(board.rooks_queens & their_pieces, occ);
+
+	if (M & KnightMaterial)
+		unsafe |= attacks_from<Knight>(board.knights & their_pieces);
+
+	if (M & PawnMaterial)
+		unsafe |= pawn_attacks<Them>(board.pawns & their_pieces);
+
+	return unsafe;
 }
 
-template <Colour us> inline Bitboard pinned_pieces(const Board &board)
+template <Colour us, Material M = AllMaterial> inline Bitboard pinned_pieces(const Board &board)
 {
+	if (!(M & (DiagonalMaterial | OrthogonalMaterial)))
+		return 0;
+
 	const auto ksq = us == White ? board.white_king : board.black_king;
 	const auto friendly = us == White ? board.white_pieces : board.black_pieces;
 	const auto enemy = us == White ? board.black_pieces : board.white_pieces;
 	const auto occ = friendly | enemy;
 
-	auto candidates = ((attacks_from<Bishop>(ksq) & board.bishops_queens) |
-					   (attacks_from<Rook>(ksq) & board.rooks_queens)) &
-					  enemy;
+	Bitboard candidates = 0;
+
+	if (M & DiagonalMaterial)
+		candidates |= attacks_from<Bishop>(ksq) & board.bishops_queens & enemy;
+
+	if (M & OrthogonalMaterial)
+		candidates |= attacks_from<Rook>(ksq) & board.rooks_queens & enemy;
 
 	Bitboard pinned = 0;
 
@@ -1725,6 +2011,38 @@ template <Colour us> inline Bitboard pinned_pieces(const Board &board)
 	return pinned;
 }
 
+// Squares a piece on sq pinned to the king on ksq may move to (ignoring occupancy)
+constexpr Bitboard pin_ray(const Square ksq, const Square sq)
+{
+	return line_connecting(ksq, sq);
+}
+
+// Non-king pieces which may be able to evade a single check
+struct Evaders
+{
+	Bitboard knights, bishops_queens, rooks_queens, pawns;
+	Bitboard targets;
+};
+
+template <Colour Us, Material M = AllMaterial>
+inline Evaders evaders(const Board &board, const Bitboard checkers)
+{
+	const auto ksq = Us == White ? board.white_king : board.black_king;
+	const auto friendly = Us == White ? board.white_pieces : board.black_pieces;
+	const auto checker = static_cast<Square>(lsb(checkers));
+
+	// Capture the checker or interpose
+	const auto targets = line_between(ksq, checker) | checkers;
+
+	// Pinned pieces can never evade a check. Of the rest, only pieces that
+	// are aligned with (or a knight's move away from) a target are candidates.
+	const auto movers = friendly & ~pinned_pieces<Us, M>(board);
+
+	return {board.knights & movers & attacks_from<Knight>(targets),
+			board.bishops_queens & movers & attacks_from<Bishop>(targets),
+			board.rooks_queens & movers & attacks_from<Rook>(targets), board.pawns & movers, targets};
+}
+
 template <Colour Us, PieceType T, PieceType Promotion = Pawn>
 void do_move(Board &board, const Square from, const Square to)
 {
@@ -1858,17 +2176,17 @@ inline int parse_and_push_uci(Board &board, std::string_view uci)
 	if (promotion != Pawn)
 	{
 		if (promotion == Knight)
-			board.side == White ? do_move<White, Knight>(board, from, to)
-								: do_move<Black, Knight>(board, from, to);
+			board.side == White ? do_move<White, Pawn, Knight>(board, from, to)
+								: do_move<Black, Pawn, Knight>(board, from, to);
 		else if (promotion == Bishop)
-			board.side == White ? do_move<White, Bishop>(board, from, to)
-								: do_move<Black, Bishop>(board, from, to);
+			board.side == White ? do_move<White, Pawn, Bishop>(board, from, to)
+								: do_move<Black, Pawn, Bishop>(board, from, to);
 		else if (promotion == Rook)
-			board.side == White ? do_move<White, Rook>(board, from, to)
-								: do_move<Black, Rook>(board, from, to);
+			board.side == White ? do_move<White, Pawn, Rook>(board, from, to)
+								: do_move<Black, Pawn, Rook>(board, from, to);
 		else if (promotion == Queen)
-			board.side == White ? do_move<White, Queen>(board, from, to)
-								: do_move<Black, Queen>(board, from, to);
+			board.side == White ? do_move<White, Pawn, Queen>(board, from, to)
+								: do_move<Black, Pawn, Queen>(board, from, to);
 		else
 			return 2;
 	}
@@ -1897,165 +2215,568 @@ inline int parse_and_push_uci(Board &board, std::string_view uci)
 	return 0;
 }
 
-using Nodes = std::uint64_t;
-using Depth = std::uint8_t;
+//
+// Move lists
+//  Legal move generation for the tools built around perft (estimation, verification, etc.).
+//  perft itself never materialises moves, so this favours simplicity over speed:
+//  pseudo-legal moves are played out and kept if they don't leave the king in check.
+//
 
-template <Colour Us, PieceType T, bool Pinned, bool Divide = false>
-inline Nodes perft_type(const Board &board, Bitboard pieces, const Bitboard targets,
-						const Depth depth);
+struct Move
+{
+	Square from, to;
+	PieceType piece, promotion; // Queens move as Queen, 'promotion' is Pawn for non-promotions
+};
+
+template <> struct fmt::formatter<Move>
+{
+	template <typename ParseContext> constexpr auto parse(ParseContext &ctx)
+	{
+		return ctx.begin();
+	}
 
-template <Colour Us, bool Divide = false>
-inline Nodes perft_king(const Board &board, const Bitboard targets, const Depth depth);
+	template <typename FormatContext> constexpr auto format(const Move &move, FormatContext &ctx)
+	{
+		return move.promotion != Pawn
+				   ? format_to(ctx.out(), "{}{}{}", move.from, move.to,
+							   PieceTypeChars[move.promotion])
+				   : format_to(ctx.out(), "{}{}", move.from, move.to);
+	}
+};
 
-template <Colour Us, bool Pinned, bool Divide = false>
-inline Nodes perft_pawns(const Board &board, const Bitboard pawns, const Bitboard targets,
-						 const Depth depth);
+struct MoveList
+{
+	std::array<Move, 256> moves;
+	std::size_t size = 0;
 
-template <Colour Us> inline Nodes count_moves(const Board &board);
+	void push_back(const Move &move)
+	{
+		moves[size++] = move;
+	}
+
+	const Move &operator[](const std::size_t i) const
+	{
+		return moves[i];
+	}
+
+	const Move *begin() const
+	{
+		return moves.data();
+	}
 
-template <Colour Us, bool Divide = false>
-inline Nodes perft_colour(const Board &board, const Depth depth)
+	const Move *end() const
+	{
+		return moves.data() + size;
+	}
+};
+
+template <Colour Us> inline void make_move(Board &board, const Move &move)
 {
-	if (depth == 0)
-		return 1;
+	switch (move.piece)
+	{
+	case Pawn:
+		switch (move.promotion)
+		{
+		case Knight: return do_move<Us, Pawn, Knight>(board, move.from, move.to);
+		case Bishop: return do_move<Us, Pawn, Bishop>(board, move.from, move.to);
+		case Rook: return do_move<Us, Pawn, Rook>(board, move.from, move.to);
+		case Queen: return do_move<Us, Pawn, Queen>(board, move.from, move.to);
+		default: return do_move<Us, Pawn>(board, move.from, move.to);
+		}
+	case Knight: return do_move<Us, Knight>(board, move.from, move.to);
+	case Bishop: return do_move<Us, Bishop>(board, move.from, move.to);
+	case Rook: return do_move<Us, Rook>(board, move.from, move.to);
+	case Queen: return do_move<Us, Queen>(board, move.from, move.to);
+	case King: return do_move<Us, King>(board, move.from, move.to);
+	}
+}
 
-	if (!Divide && depth == 1)
-		return count_moves<Us>(board);
+inline void make_move(Board &board, const Move &move)
+{
+	board.side == White ? make_move<White>(board, move) : make_move<Black>(board, move);
+}
+
+template <Colour Us> inline MoveList legal_moves(const Board &board)
+{
+	MoveList list;
 
-	Nodes nodes = 0, cnt;
+	constexpr auto Rank7 = Us == White ? Rank::Seven : Rank::Two;
+	constexpr auto Rank3 = Us == White ? Rank::Three : Rank::Six;
+	constexpr auto Up = Us == White ? North : South;
 
 	const auto ksq = Us == White ? board.white_king : board.black_king;
+	const auto eksq = Us == White ? board.black_king : board.white_king;
 	const auto friendly = Us == White ? board.white_pieces : board.black_pieces;
 	const auto enemy = Us == White ? board.black_pieces : board.white_pieces;
+	const auto occ = friendly | enemy;
 
-	const auto unsafe = unsafe_squares<Us>(board);
-
-	auto targets = ~friendly;
-	auto mask = friendly;
+	const auto add = [&](const PieceType piece, const Square from, Bitboard to) {
+		while (to)
+		{
+			const auto sq = static_cast<Square>(lsb(to));
+			to &= (to - 1);
 
-	nodes += perft_king<Us, Divide>(board, targets & ~unsafe, depth);
+			const bool promotion = piece == Pawn && (rank_bb(Rank7) & from);
+			for (auto p = promotion ? Knight : Pawn; p <= (promotion ? Queen : Pawn);
+				 p = static_cast<PieceType>(p + 1))
+			{
+				const Move move {from, sq, piece, p};
 
-	// In check
-	if (unsafe & ksq)
-	{
-		const auto checkers = checks<Us>(board);
+				Board new_board = board;
+				make_move<Us>(new_board, move);
 
-		if (more_than_one(checkers))
-			return nodes;
+				// checks() ignores the enemy king, which only matters for our king's moves
+				if (!checks<Us>(new_board) && !(piece == King && (attacks_from<King>(eksq) & sq)))
+					list.push_back(move);
+			}
+		}
+	};
 
-		const auto checker = static_cast<Square>(lsb(checkers));
-		targets &= line_between(ksq, checker) | checkers;
-	}
-	else
+	for (auto bb = board.pawns & friendly; bb; bb &= (bb - 1))
 	{
-		// Short
-		if ((board.castling_rights.all & castling_rights(Us, true).all) &&
-			!((friendly | enemy) & castling_rook_path(Us, true)) &&
-			!(unsafe & castling_king_path(Us, true)))
-		{
-			Board new_board = board;
-			do_move<Us, King>(new_board, ksq, castling_king_dest(Us, true));
-			cnt = perft_colour<~Us>(new_board, depth - 1);
-			nodes += cnt;
+		const auto from = static_cast<Square>(lsb(bb));
+		const auto single_push = shift<Up>(square_bb(from)) & ~occ;
+		const auto double_push = shift<Up>(single_push & Rank3) & ~occ;
+		const auto ep = is_valid(board.en_passant) ? square_bb(board.en_passant) : 0;
 
-			if (Divide)
-				fmt::print("{}{}: {}\n", ksq, castling_king_dest(Us, true), cnt);
-		}
+		add(Pawn, from, single_push | double_push | (pawn_attacks(Us, from) & (enemy | ep)));
+	}
 
-		// Long
-		if ((board.castling_rights.all & castling_rights(Us, false).all) &&
-			!((friendly | enemy) & castling_rook_path(Us, false)) &&
-			!(unsafe & castling_king_path(Us, false)))
-		{
-			Board new_board = board;
-			do_move<Us, King>(new_board, ksq, castling_king_dest(Us, false));
-			cnt = perft_colour<~Us>(new_board, depth - 1);
-			nodes += cnt;
+	for (auto bb = board.knights & friendly; bb; bb &= (bb - 1))
+	{
+		const auto from = static_cast<Square>(lsb(bb));
+		add(Knight, from, attacks_from<Knight>(from) & ~friendly);
+	}
 
-			if (Divide)
-				fmt::print("{}{}: {}\n", ksq, castling_king_dest(Us, false), cnt);
-		}
+	for (auto bb = (board.bishops_queens | board.rooks_queens) & friendly; bb; bb &= (bb - 1))
+	{
+		const auto from = static_cast<Square>(lsb(bb));
+		const bool diagonal = board.bishops_queens & from, orthogonal = board.rooks_queens & from;
+		const auto piece = diagonal && orthogonal ? Queen : diagonal ? Bishop : Rook;
+
+		add(piece, from,
+			((diagonal ? attacks_from<Bishop>(from, occ) : 0) |
+			 (orthogonal ? attacks_from<Rook>(from, occ) : 0)) &
+				~friendly);
 	}
 
-	const auto pinned = pinned_pieces<Us>(board);
+	add(King, ksq, attacks_from<King>(ksq) & ~friendly);
 
-	nodes += perft_type<Us, Knight, false, Divide>(board, board.knights & mask & ~pinned, targets,
-												   depth);
-	nodes += perft_type<Us, Bishop, false, Divide>(board, board.bishops_queens & mask & ~pinned,
-												   targets, depth);
-	nodes += perft_type<Us, Rook, false, Divide>(board, board.rooks_queens & mask & ~pinned,
-												 targets, depth);
-	nodes += perft_pawns<Us, false, Divide>(board, board.pawns & mask & ~pinned, targets, depth);
+	const auto unsafe = unsafe_squares<Us>(board);
 
-	if (!(unsafe & ksq))
+	for (const bool oo : {true, false})
 	{
-		nodes += perft_type<Us, Bishop, true, Divide>(board, board.bishops_queens & mask & pinned,
-													  targets, depth);
-		nodes += perft_type<Us, Rook, true, Divide>(board, board.rooks_queens & mask & pinned,
-													targets, depth);
-		nodes += perft_pawns<Us, true, Divide>(board, board.pawns & mask & pinned, targets, depth);
+		if ((board.castling_rights.all & castling_rights(Us, oo).all) && !(unsafe & ksq) &&
+			!(occ & castling_rook_path(Us, oo)) && !(unsafe & castling_king_path(Us, oo)))
+			list.push_back({ksq, castling_king_dest(Us, oo), King, Pawn});
 	}
 
-	return nodes;
+	return list;
 }
 
-template <Colour Us, PieceType T, bool Pinned, bool Divide>
-inline Nodes perft_type(const Board &board, Bitboard pieces, const Bitboard targets,
-						const Depth depth)
+inline MoveList legal_moves(const Board &board)
 {
-	static_assert(T != King && T != Pawn, "Use count_king_moves/count_pawn_moves instead");
-
-	Nodes nodes = 0, cnt;
-	Board new_board;
+	return board.side == White ? legal_moves<White>(board) : legal_moves<Black>(board);
+}
 
-	const auto ksq = Us == White ? board.white_king : board.black_king;
-	const auto occ = board.white_pieces | board.black_pieces;
+// Like parse_and_push_uci(), but also returns 6 if the move isn't legal. 'board' is only
+// changed if the move is played.
+inline int push_legal_uci(Board &board, const std::string_view uci)
+{
+	Board new_board = board;
+	if (const auto status = parse_and_push_uci(new_board, uci); status != 0)
+		return status;
 
-	while (pieces)
+	for (const auto &move : legal_moves(board))
 	{
-		const auto from = static_cast<Square>(lsb(pieces));
-		auto attacks = attacks_from<T>(from, occ) & targets;
-
-		while (attacks)
+		if (fmt::format("{}", move) == uci)
 		{
-			const auto to = static_cast<Square>(lsb(attacks));
-			attacks &= (attacks - 1);
-
-			if (Pinned && !aligned(ksq, from, to))
-				continue;
-
-			new_board = board;
-			do_move<Us, T>(new_board, from, to);
-			cnt = perft_colour<~Us>(new_board, depth - 1);
-			nodes += cnt;
-
-			if (Divide)
-				fmt::print("{}{}: {}\n", from, to, cnt);
+			board = new_board;
+			return 0;
 		}
-
-		pieces &= (pieces - 1);
 	}
 
-	return nodes;
+	return 6;
 }
 
-template <Colour Us, bool Divide>
-inline Nodes perft_king(const Board &board, const Bitboard targets, const Depth depth)
-{
-	Nodes nodes = 0, cnt;
-	Board new_board;
+using Nodes = std::uint64_t;
+using Depth = std::uint8_t;
 
-	const auto ksq = Us == White ? board.white_king : board.black_king;
+//
+// Profiling
+//  With USE_PROFILE the perft functions count, per remaining depth, the positions they expand
+//  and how often the rarer generator paths are taken, in thread-local counters which are
+//  merged when threads exit. Without it, profile() and ProfileTimer compile to nothing.
+//  count_moves() is counted at depth 1, including its calls for Stats' checkmate test.
+//
 
-	auto attacks = attacks_from<King>(ksq) & targets;
-	while (attacks)
-	{
-		const auto to = static_cast<Square>(lsb(attacks));
-		attacks &= (attacks - 1);
+#if defined(USE_PROFILE)
+constexpr bool Profiling = true;
+#else
+constexpr bool Profiling = false;
+#endif
+
+#if defined(USE_PROFILE_TIMING)
+constexpr bool ProfileTiming = true;
+#else
+constexpr bool ProfileTiming = false;
+#endif
+
+struct Profile
+{
+	enum Event
+	{
+		Positions,	 // Positions expanded
+		InCheck,	 // ... which are in check
+		DoubleCheck, // ... which are in double check
+		Pinned,		 // ... which have pinned pieces
+		EnPassant,	 // Legal en passant captures
+		Castling,	 // Legal castling moves
+		Promotion,	 // Legal promotions (each of the four pieces)
+		Cycles,		 // Time stamp counter cycles, including deeper plies
+		Events
+	};
+
+	std::array<std::array<std::uint64_t, Events>, 256> counts {}; // Per remaining depth
+
+	Profile &operator+=(const Profile &other)
+	{
+		for (std::size_t d = 0; d < counts.size(); ++d)
+			for (std::size_t e = 0; e < Events; ++e)
+				counts[d][e] += other.counts[d][e];
+
+		return *this;
+	}
+};
+
+#if defined(USE_PROFILE)
+inline std::mutex profile_mutex;
+inline Profile profile_total;
+
+struct ThreadProfile : Profile
+{
+	~ThreadProfile()
+	{
+		std::lock_guard lock(profile_mutex);
+		profile_total += *this;
+	}
+};
+
+inline thread_local ThreadProfile thread_profile;
+#endif
+
+template <Profile::Event E> inline void profile(const Depth depth, const std::uint64_t n = 1)
+{
+#if defined(USE_PROFILE)
+	thread_profile.counts[depth][E] += n;
+#else
+	(void)depth, (void)n;
+#endif
+}
+
+// The counts of exited threads and the calling thread
+inline Profile profile_snapshot()
+{
+#if defined(USE_PROFILE)
+	std::lock_guard lock(profile_mutex);
+	auto total = profile_total;
+	total += thread_profile;
+	return total;
+#else
+	return {};
+#endif
+}
+
+inline void profile_reset()
+{
+#if defined(USE_PROFILE)
+	std::lock_guard lock(profile_mutex);
+	profile_total = {};
+	static_cast<Profile &>(thread_profile) = {};
+#endif
+}
+
+// Adds the cycles spent in its scope to the depth's Cycles
+struct ProfileTimer
+{
+#if defined(USE_PROFILE_TIMING)
+	explicit ProfileTimer(const Depth depth) : depth(depth), start(__rdtsc()) {}
+
+	~ProfileTimer()
+	{
+		profile<Profile::Cycles>(depth, __rdtsc() - start);
+	}
+
+	Depth depth;
+	std::uint64_t start;
+#else
+	explicit ProfileTimer(const Depth) {}
+#endif
+};
+
+//
+// Counting policies
+//  The perft functions are templated on what they count. Nodes counts leaf
+//  nodes only, Stats also classifies the last move (and position) of each path
+//  like the tables at https://www.chessprogramming.org/Perft_Results
+//
+
+struct Stats
+{
+	Nodes nodes = 0;
+	Nodes captures = 0, en_passants = 0, castles = 0, promotions = 0;
+	Nodes checks = 0, discovery_checks = 0, double_checks = 0, checkmates = 0;
+
+	Stats &operator+=(const Stats &other)
+	{
+		nodes += other.nodes;
+		captures += other.captures;
+		en_passants += other.en_passants;
+		castles += other.castles;
+		promotions += other.promotions;
+		checks += other.checks;
+		discovery_checks += other.discovery_checks;
+		double_checks += other.double_checks;
+		checkmates += other.checkmates;
+
+		return *this;
+	}
+
+	friend Stats operator+(Stats a, const Stats &b)
+	{
+		return a += b;
+	}
+};
+
+template <> struct fmt::formatter<Stats> : fmt::formatter<Nodes>
+{
+	template <typename FormatContext> auto format(const Stats &stats, FormatContext &ctx)
+	{
+		return fmt::formatter<Nodes>::format(stats.nodes, ctx);
+	}
+};
+
+template <Colour Us, PieceType T, bool Pinned, bool Divide = false, Material M = AllMaterial,
+		  typename Counter = Nodes>
+inline Counter perft_type(const Board &board, Bitboard pieces, const Bitboard targets,
+						const Depth depth);
+
+template <Colour Us, bool Divide = false, Material M = AllMaterial, typename Counter = Nodes>
+inline Counter perft_king(const Board &board, const Bitboard targets, const Depth depth);
+
+template <Colour Us, bool Pinned, bool Divide = false, Material M = AllMaterial,
+		  typename Counter = Nodes>
+inline Counter perft_pawns(const Board &board, const Bitboard pawns, const Bitboard targets,
+						 const Depth depth);
+
+template <Colour Us, bool Divide = false, Material M = AllMaterial, typename Counter = Nodes>
+inline Counter perft_evasions(const Board &board, const Bitboard checkers, const Depth depth);
+
+template <Colour Us, Material M = AllMaterial, typename Counter = Nodes>
+inline Counter count_moves(const Board &board);
+
+template <Colour Us, bool Divide = false, Material M = AllMaterial, typename Counter = Nodes>
+inline Counter perft_colour(const Board &board, const Depth depth);
+
+template <Colour Us, std::size_t... Ms>
+constexpr auto make_perft_material_lut(std::index_sequence<Ms...>)
+{
+	return std::array {&perft_colour<Us, false, static_cast<Material>(Ms)>...};
+}
+
+template <Colour Us>
+static constexpr auto PerftByMaterial =
+	make_perft_material_lut<Us>(std::make_index_sequence<MaterialSignatures>());
+
+// Dispatches to the perft_colour instantiation for the board's material signature
+template <Colour Us, bool Divide = false, typename Counter = Nodes>
+inline Counter perft_dispatch(const Board &board, const Depth depth)
+{
+	// Divide only applies at the root and statistics are a debugging aid,
+	// neither is worth specialising
+	if constexpr (!std::is_same_v<Counter, Nodes>)
+		return perft_colour<Us, Divide, AllMaterial, Counter>(board, depth);
+	else if (Divide)
+		return perft_colour<Us, true>(board, depth);
+	else
+		return PerftByMaterial<Us>[material(board)](board, depth);
+}
+
+// Recurses into the position after a move. A capture may have removed the last
+// piece of a type from the board, in which case the signature is recomputed.
+template <Colour Us, Material M, typename Counter>
+inline Counter perft_child(const Board &board, const bool capture, const Depth depth)
+{
+	return capture ? perft_dispatch<Us, false, Counter>(board, depth)
+				   : perft_colour<Us, false, M, Counter>(board, depth);
+}
+
+template <Colour Us, bool Divide, Material M, typename Counter>
+inline Counter perft_colour(const Board &board, const Depth depth)
+{
+	if (depth == 0)
+		return Counter {1};
+
+	profile<Profile::Positions>(depth);
+	const ProfileTimer timer(depth);
+
+	if (!Divide && depth == 1)
+		return count_moves<Us, M, Counter>(board);
+
+	Counter nodes {}, cnt;
+
+	const auto ksq = Us == White ? board.white_king : board.black_king;
+	const auto friendly = Us == White ? board.white_pieces : board.black_pieces;
+	const auto enemy = Us == White ? board.black_pieces : board.white_pieces;
+
+	const auto unsafe = unsafe_squares<Us, M>(board);
+
+	const auto targets = ~friendly;
+	const auto mask = friendly;
+
+	nodes += perft_king<Us, Divide, M, Counter>(board, targets & ~unsafe, depth);
+
+	// In check
+	if (unsafe & ksq)
+	{
+		profile<Profile::InCheck>(depth);
+
+		const auto checkers = checks<Us, M>(board);
+
+		if (more_than_one(checkers))
+		{
+			profile<Profile::DoubleCheck>(depth);
+			return nodes;
+		}
+
+		return nodes + perft_evasions<Us, Divide, M, Counter>(board, checkers, depth);
+	}
+
+	// Short
+	if ((board.castling_rights.all & castling_rights(Us, true).all) &&
+		!((friendly | enemy) & castling_rook_path(Us, true)) &&
+		!(unsafe & castling_king_path(Us, true)))
+	{
+		Board new_board = board;
+		do_move<Us, King>(new_board, ksq, castling_king_dest(Us, true));
+		cnt = perft_child<~Us, M, Counter>(new_board, false, depth - 1);
+		nodes += cnt;
+		profile<Profile::Castling>(depth);
+
+		if (Divide)
+			fmt::print("{}{}: {}\n", ksq, castling_king_dest(Us, true), cnt);
+	}
+
+	// Long
+	if ((board.castling_rights.all & castling_rights(Us, false).all) &&
+		!((friendly | enemy) & castling_rook_path(Us, false)) &&
+		!(unsafe & castling_king_path(Us, false)))
+	{
+		Board new_board = board;
+		do_move<Us, King>(new_board, ksq, castling_king_dest(Us, false));
+		cnt = perft_child<~Us, M, Counter>(new_board, false, depth - 1);
+		nodes += cnt;
+		profile<Profile::Castling>(depth);
+
+		if (Divide)
+			fmt::print("{}{}: {}\n", ksq, castling_king_dest(Us, false), cnt);
+	}
+
+	const auto pinned = pinned_pieces<Us, M>(board);
+
+	if (pinned)
+		profile<Profile::Pinned>(depth);
+
+	if (M & KnightMaterial)
+		nodes += perft_type<Us, Knight, false, Divide, M, Counter>(
+			board, board.knights & mask & ~pinned, targets, depth);
+
+	if (M & DiagonalMaterial)
+		nodes += perft_type<Us, Bishop, false, Divide, M, Counter>(
+			board, board.bishops_queens & mask & ~pinned, targets, depth);
+
+	if (M & OrthogonalMaterial)
+		nodes += perft_type<Us, Rook, false, Divide, M, Counter>(
+			board, board.rooks_queens & mask & ~pinned, targets, depth);
+
+	if (M & PawnMaterial)
+		nodes += perft_pawns<Us, false, Divide, M, Counter>(board, board.pawns & mask & ~pinned,
+															targets, depth);
+
+	if (M & DiagonalMaterial)
+		nodes += perft_type<Us, Bishop, true, Divide, M, Counter>(
+			board, board.bishops_queens & mask & pinned, targets, depth);
+
+	if (M & OrthogonalMaterial)
+		nodes += perft_type<Us, Rook, true, Divide, M, Counter>(
+			board, board.rooks_queens & mask & pinned, targets, depth);
+
+	if (M & PawnMaterial)
+		nodes += perft_pawns<Us, true, Divide, M, Counter>(board, board.pawns & mask & pinned,
+														   targets, depth);
+
+	return nodes;
+}
+
+template <Colour Us, PieceType T, bool Pinned, bool Divide, Material M, typename Counter>
+inline Counter perft_type(const Board &board, Bitboard pieces, const Bitboard targets,
+						const Depth depth)
+{
+	static_assert(T != King && T != Pawn, "Use count_king_moves/count_pawn_moves instead");
+
+	Counter nodes {}, cnt;
+	Board new_board;
+
+	const auto ksq = Us == White ? board.white_king : board.black_king;
+	const auto enemy = Us == White ? board.black_pieces : board.white_pieces;
+	const auto occ = board.white_pieces | board.black_pieces;
+
+	while (pieces)
+	{
+		const auto from = static_cast<Square>(lsb(pieces));
+		auto attacks = attacks_from<T>(from, occ) & targets;
+
+		if (Pinned)
+			attacks &= pin_ray(ksq, from);
+
+		while (attacks)
+		{
+			const auto to = static_cast<Square>(lsb(attacks));
+			attacks &= (attacks - 1);
+
+			new_board = board;
+			do_move<Us, T>(new_board, from, to);
+			cnt = perft_child<~Us, M, Counter>(new_board, enemy & to, depth - 1);
+			nodes += cnt;
+
+			if (Divide)
+				fmt::print("{}{}: {}\n", from, to, cnt);
+		}
+
+		pieces &= (pieces - 1);
+	}
+
+	return nodes;
+}
+
+template <Colour Us, bool Divide, Material M, typename Counter>
+inline Counter perft_king(const Board &board, const Bitboard targets, const Depth depth)
+{
+	Counter nodes {}, cnt;
+	Board new_board;
+
+	const auto ksq = Us == White ? board.white_king : board.black_king;
+	const auto enemy = Us == White ? board.black_pieces : board.white_pieces;
+
+	auto attacks = attacks_from<King>(ksq) & targets;
+	while (attacks)
+	{
+		const auto to = static_cast<Square>(lsb(attacks));
+		attacks &= (attacks - 1);
 
 		new_board = board;
 		do_move<Us, King>(new_board, ksq, to);
-		cnt = perft_colour<~Us>(new_board, depth - 1);
+		cnt = perft_child<~Us, M, Counter>(new_board, enemy & to, depth - 1);
 		nodes += cnt;
 
 		if (Divide)
@@ -2065,15 +2786,20 @@ inline Nodes perft_king(const Board &board, const Bitboard targets, const Depth
 	return nodes;
 }
 
-template <Colour Us, bool Divide = false>
-inline Nodes perft_promotions(const Board &board, const Square from, const Square to,
+template <Colour Us, bool Divide = false, Material M = AllMaterial, typename Counter = Nodes>
+inline Counter perft_promotions(const Board &board, const Square from, const Square to,
 							  const Depth depth)
 {
-	Nodes nodes = 0, cnt;
+	Counter nodes {}, cnt;
+
+	const auto enemy = Us == White ? board.black_pieces : board.white_pieces;
+	const bool capture = enemy & to;
+
+	profile<Profile::Promotion>(depth, 4);
 
 	Board new_board = board;
 	do_move<Us, Pawn, Knight>(new_board, from, to);
-	cnt = perft_colour<~Us>(new_board, depth - 1);
+	cnt = perft_child<~Us, M | promotion_material(Knight), Counter>(new_board, capture, depth - 1);
 	nodes += cnt;
 
 	if (Divide)
@@ -2081,7 +2807,7 @@ inline Nodes perft_promotions(const Board &board, const Square from, const Squar
 
 	new_board = board;
 	do_move<Us, Pawn, Bishop>(new_board, from, to);
-	cnt = perft_colour<~Us>(new_board, depth - 1);
+	cnt = perft_child<~Us, M | promotion_material(Bishop), Counter>(new_board, capture, depth - 1);
 	nodes += cnt;
 
 	if (Divide)
@@ -2089,7 +2815,7 @@ inline Nodes perft_promotions(const Board &board, const Square from, const Squar
 
 	new_board = board;
 	do_move<Us, Pawn, Rook>(new_board, from, to);
-	cnt = perft_colour<~Us>(new_board, depth - 1);
+	cnt = perft_child<~Us, M | promotion_material(Rook), Counter>(new_board, capture, depth - 1);
 	nodes += cnt;
 
 	if (Divide)
@@ -2097,7 +2823,7 @@ inline Nodes perft_promotions(const Board &board, const Square from, const Squar
 
 	new_board = board;
 	do_move<Us, Pawn, Queen>(new_board, from, to);
-	cnt = perft_colour<~Us>(new_board, depth - 1);
+	cnt = perft_child<~Us, M | promotion_material(Queen), Counter>(new_board, capture, depth - 1);
 	nodes += cnt;
 
 	if (Divide)
@@ -2106,11 +2832,11 @@ inline Nodes perft_promotions(const Board &board, const Square from, const Squar
 	return nodes;
 }
 
-template <Colour Us, bool Pinned, bool Divide>
-inline Nodes perft_pawns(const Board &board, const Bitboard pawns, const Bitboard targets,
+template <Colour Us, bool Pinned, bool Divide, Material M, typename Counter>
+inline Counter perft_pawns(const Board &board, const Bitboard pawns, const Bitboard targets,
 						 const Depth depth)
 {
-	Nodes nodes = 0, cnt;
+	Counter nodes {}, cnt;
 	Board new_board;
 
 	constexpr auto Rank3 = Us == White ? Rank::Three : Rank::Six;
@@ -2143,8 +2869,9 @@ inline Nodes perft_pawns(const Board &board, const Bitboard pawns, const Bitboar
 
 				Board new_board = board;
 				do_move<Us, Pawn>(new_board, from, board.en_passant);
-				cnt = perft_colour<~Us>(new_board, depth - 1);
+				cnt = perft_child<~Us, M, Counter>(new_board, true, depth - 1);
 				nodes += cnt;
+				profile<Profile::EnPassant>(depth);
 
 				if (Divide)
 					fmt::print("{}{}: {}\n", from, board.en_passant, cnt);
@@ -2152,10 +2879,14 @@ inline Nodes perft_pawns(const Board &board, const Bitboard pawns, const Bitboar
 		}
 	}
 
-	const auto pawns_on_7 = pawns & Rank7, pawns_not_on_7 = pawns & ~pawns_on_7;
+	// Pinned pawns may only move along their pin ray: pawns pinned on the king's file
+	// can only push, pawns pinned on a diagonal can only capture along it.
+	const auto pushers = Pinned ? pawns & file_bb(ksq) : pawns;
+	const auto west_capturers = Pinned ? pawns & line_through<UpWest>(ksq) : pawns;
+	const auto east_capturers = Pinned ? pawns & line_through<UpEast>(ksq) : pawns;
 
 	// Pawn push, w/o promotion
-	const auto single_push = shift<Up>(pawns_not_on_7) & empty;
+	const auto single_push = shift<Up>(pushers & ~rank_bb(Rank7)) & empty;
 	auto bb = single_push & targets;
 	while (bb)
 	{
@@ -2163,12 +2894,9 @@ inline Nodes perft_pawns(const Board &board, const Bitboard pawns, const Bitboar
 		const auto from = to - Up;
 		bb &= (bb - 1);
 
-		if (Pinned && !aligned(ksq, from, to))
-			continue;
-
 		new_board = board;
 		do_move<Us, Pawn>(new_board, from, to);
-		cnt = perft_colour<~Us>(new_board, depth - 1);
+		cnt = perft_child<~Us, M, Counter>(new_board, false, depth - 1);
 		nodes += cnt;
 
 		if (Divide)
@@ -2183,12 +2911,9 @@ inline Nodes perft_pawns(const Board &board, const Bitboard pawns, const Bitboar
 		const auto from = to - Up * 2;
 		bb &= (bb - 1);
 
-		if (Pinned && !aligned(ksq, from, to))
-			continue;
-
 		new_board = board;
 		do_move<Us, Pawn>(new_board, from, to);
-		cnt = perft_colour<~Us>(new_board, depth - 1);
+		cnt = perft_child<~Us, M, Counter>(new_board, false, depth - 1);
 		nodes += cnt;
 
 		if (Divide)
@@ -2198,31 +2923,28 @@ inline Nodes perft_pawns(const Board &board, const Bitboard pawns, const Bitboar
 	// Promotions, w/o captures
 	if (!Pinned)
 	{
-		bb = shift<Up>(pawns_on_7) & empty & targets;
+		bb = shift<Up>(pushers & Rank7) & empty & targets;
 		while (bb)
 		{
 			const auto to = static_cast<Square>(lsb(bb));
 			const auto from = to - Up;
 			bb &= (bb - 1);
 
-			nodes += perft_promotions<Us, Divide>(board, from, to, depth);
+			nodes += perft_promotions<Us, Divide, M, Counter>(board, from, to, depth);
 		}
 	}
 
 	// Captures, w/o promotion, 1/2
-	bb = shift<UpWest>(pawns_not_on_7) & enemy & targets;
+	bb = shift<UpWest>(west_capturers & ~rank_bb(Rank7)) & enemy & targets;
 	while (bb)
 	{
 		const auto to = static_cast<Square>(lsb(bb));
 		const auto from = to - UpWest;
 		bb &= (bb - 1);
 
-		if (Pinned && !aligned(ksq, from, to))
-			continue;
-
 		new_board = board;
 		do_move<Us, Pawn>(new_board, from, to);
-		cnt = perft_colour<~Us>(new_board, depth - 1);
+		cnt = perft_child<~Us, M, Counter>(new_board, true, depth - 1);
 		nodes += cnt;
 
 		if (Divide)
@@ -2230,19 +2952,16 @@ inline Nodes perft_pawns(const Board &board, const Bitboard pawns, const Bitboar
 	}
 
 	// Captures, w/o promotion, 2/2
-	bb = shift<UpEast>(pawns_not_on_7) & enemy & targets;
+	bb = shift<UpEast>(east_capturers & ~rank_bb(Rank7)) & enemy & targets;
 	while (bb)
 	{
 		const auto to = static_cast<Square>(lsb(bb));
 		const auto from = to - UpEast;
 		bb &= (bb - 1);
 
-		if (Pinned && !aligned(ksq, from, to))
-			continue;
-
 		new_board = board;
 		do_move<Us, Pawn>(new_board, from, to);
-		cnt = perft_colour<~Us>(new_board, depth - 1);
+		cnt = perft_child<~Us, M, Counter>(new_board, true, depth - 1);
 		nodes += cnt;
 
 		if (Divide)
@@ -2250,145 +2969,371 @@ inline Nodes perft_pawns(const Board &board, const Bitboard pawns, const Bitboar
 	}
 
 	// Captures, w/ promotion, 1/2
-	bb = shift<UpWest>(pawns_on_7) & enemy & targets;
+	bb = shift<UpWest>(west_capturers & Rank7) & enemy & targets;
 	while (bb)
 	{
 		const auto to = static_cast<Square>(lsb(bb));
 		const auto from = to - UpWest;
 		bb &= (bb - 1);
 
-		if (Pinned && !aligned(ksq, from, to))
-			continue;
-
-		nodes += perft_promotions<Us, Divide>(board, from, to, depth);
+		nodes += perft_promotions<Us, Divide, M, Counter>(board, from, to, depth);
 	}
 
 	// Captures, w/ promotion, 2/2
-	bb = shift<UpEast>(pawns_on_7) & enemy & targets;
+	bb = shift<UpEast>(east_capturers & Rank7) & enemy & targets;
 	while (bb)
 	{
 		const auto to = static_cast<Square>(lsb(bb));
 		const auto from = to - UpEast;
 		bb &= (bb - 1);
 
-		if (Pinned && !aligned(ksq, from, to))
-			continue;
-
-		nodes += perft_promotions<Us, Divide>(board, from, to, depth);
+		nodes += perft_promotions<Us, Divide, M, Counter>(board, from, to, depth);
 	}
 
 	return nodes;
 }
 
-//
-// Specialised functions for counting at leaf nodes
-//
-
-template <Colour Us, PieceType T, bool Pinned>
-inline Nodes count_type(const Board &board, Bitboard pieces, const Bitboard targets);
-
-template <Colour Us, bool Pinned>
-inline Nodes count_pawn_moves(const Board &board, const Bitboard pawns, const Bitboard targets);
-
-template <Colour Us> inline Nodes count_moves(const Board &board)
+template <Colour Us, bool Divide, Material M, typename Counter>
+inline Counter perft_evasions(const Board &board, const Bitboard checkers, const Depth depth)
 {
-	Nodes nodes = 0;
+	Counter nodes {};
 
-	const auto ksq = Us == White ? board.white_king : board.black_king;
-	const auto friendly = Us == White ? board.white_pieces : board.black_pieces;
-	const auto enemy = Us == White ? board.black_pieces : board.white_pieces;
+	const auto e = evaders<Us, M>(board, checkers);
 
-	const auto unsafe = unsafe_squares<Us>(board);
+	if (M & KnightMaterial)
+		nodes += perft_type<Us, Knight, false, Divide, M, Counter>(board, e.knights, e.targets,
+																   depth);
 
-	auto targets = ~friendly;
-	auto mask = friendly;
+	if (M & DiagonalMaterial)
+		nodes += perft_type<Us, Bishop, false, Divide, M, Counter>(board, e.bishops_queens,
+																   e.targets, depth);
 
-	nodes += popcount(attacks_from<King>(ksq) & targets & ~unsafe);
+	if (M & OrthogonalMaterial)
+		nodes += perft_type<Us, Rook, false, Divide, M, Counter>(board, e.rooks_queens, e.targets,
+																 depth);
 
-	// In check
-	if (unsafe & ksq)
-	{
-		const auto checkers = checks<Us>(board);
+	if (M & PawnMaterial)
+		nodes += perft_pawns<Us, false, Divide, M, Counter>(board, e.pawns, e.targets, depth);
 
-		if (more_than_one(checkers))
-			return nodes;
+	return nodes;
+}
 
-		const auto checker = static_cast<Square>(lsb(checkers));
-		targets &= line_between(ksq, checker) | checkers;
-	}
-	else
-	{
-		// Short
-		if ((board.castling_rights.all & castling_rights(Us, true).all) &&
-			!((friendly | enemy) & castling_rook_path(Us, true)) &&
-			!(unsafe & castling_king_path(Us, true)))
-			++nodes;
+//
+// Leaf tallies
+//  The leaf counting functions pass each set of legal moves to tally(),
+//  tally_pawns() or tally_move(). When counting Nodes these are a popcount
+//  (or an increment); when counting Stats the moves are classified, still
+//  with popcounts where possible.
+//
 
-		// Long
-		if ((board.castling_rights.all & castling_rights(Us, false).all) &&
-			!((friendly | enemy) & castling_rook_path(Us, false)) &&
-			!(unsafe & castling_king_path(Us, false)))
-			++nodes;
-	}
+// Tally moves of a piece of type T from 'from' to each square in 'to'
+template <Colour Us, PieceType T>
+inline void tally(Nodes &nodes, const Board &, const Square, const Bitboard to)
+{
+	nodes += popcount(to);
+}
+
+// Tally pawn moves to each square in 'to', each from the square D behind it
+template <Colour Us, Direction D, bool Promotion>
+inline void tally_pawns(Nodes &nodes, const Board &, const Bitboard to)
+{
+	nodes += popcount(to) * (Promotion ? 4 : 1);
+}
 
-	const auto pinned = pinned_pieces<Us>(board);
+// Tally a single move
+template <Colour Us, PieceType T>
+inline void tally_move(Nodes &nodes, const Board &, const Square, const Square)
+{
+	++nodes;
+}
 
-	nodes += count_type<Us, Knight, false>(board, board.knights & mask & ~pinned, targets);
-	nodes += count_type<Us, Bishop, false>(board, board.bishops_queens & mask & ~pinned, targets);
-	nodes += count_type<Us, Rook, false>(board, board.rooks_queens & mask & ~pinned, targets);
-	nodes += count_pawn_moves<Us, false>(board, board.pawns & mask & ~pinned, targets);
+// Squares from which a piece of type T on 'from' would give check to the enemy king
+template <Colour Us, PieceType T>
+inline Bitboard check_squares(const Board &board, const Square from)
+{
+	const auto eksq = Us == White ? board.black_king : board.white_king;
+	const auto occ = board.white_pieces | board.black_pieces;
 
-	if (!(unsafe & ksq))
+	if constexpr (T == Pawn)
+		return pawn_attacks(~Us, eksq);
+	else if constexpr (T == King)
+		return 0;
+	else if constexpr (T == Bishop || T == Rook)
 	{
-		nodes += count_type<Us, Bishop, true>(board, board.bishops_queens & mask & pinned, targets);
-		nodes += count_type<Us, Rook, true>(board, board.rooks_queens & mask & pinned, targets);
-		nodes += count_pawn_moves<Us, true>(board, board.pawns & mask & pinned, targets);
+		// Queens are moved as either bishops or rooks
+		return (board.bishops_queens & board.rooks_queens & from) ? attacks_from<Queen>(eksq, occ)
+																  : attacks_from<T>(eksq, occ);
 	}
-
-	return nodes;
+	else
+		return attacks_from<T>(eksq, occ);
 }
 
-template <Colour Us, PieceType T, bool Pinned>
-inline Nodes count_type(const Board &board, Bitboard pieces, const Bitboard targets)
+// Our pieces which give a discovered check by leaving the line between one of
+// our sliding pieces and the enemy king
+template <Colour Us> inline Bitboard discoverers(const Board &board)
 {
-	static_assert(T != King && T != Pawn, "Use count_king_moves/count_pawn_moves instead");
-
-	Nodes nodes = 0;
-
-	const auto ksq = Us == White ? board.white_king : board.black_king;
+	const auto eksq = Us == White ? board.black_king : board.white_king;
+	const auto friendly = Us == White ? board.white_pieces : board.black_pieces;
 	const auto occ = board.white_pieces | board.black_pieces;
 
-	while (pieces)
-	{
-		const auto from = static_cast<Square>(lsb(pieces));
-		auto attacks = attacks_from<T>(from, occ) & targets;
+	auto candidates = ((attacks_from<Bishop>(eksq) & board.bishops_queens) |
+					   (attacks_from<Rook>(eksq) & board.rooks_queens)) &
+					  friendly;
 
-		if (!Pinned)
-			nodes += popcount(attacks);
-		else
-		{
-			while (attacks)
-			{
-				const auto to = static_cast<Square>(lsb(attacks));
-				attacks &= (attacks - 1);
+	Bitboard blockers = 0;
 
-				if (!aligned(ksq, from, to))
-					continue;
+	while (candidates)
+	{
+		const auto candidate = static_cast<Square>(lsb(candidates));
 
-				++nodes;
-			}
-		}
+		const auto between = line_between(eksq, candidate) & occ;
+		if (only_one(between))
+			blockers |= between & friendly;
 
-		pieces &= (pieces - 1);
+		candidates &= (candidates - 1);
 	}
 
-	return nodes;
+	return blockers;
 }
 
-template <Colour Us, bool Pinned>
-inline Nodes count_pawn_moves(const Board &board, const Bitboard pawns, const Bitboard targets)
+// Classify the checks given by a single move
+template <Colour Us, PieceType T, PieceType Promotion = Pawn>
+inline void tally_checks(Stats &stats, const Board &board, const Square from, const Square to)
 {
-	Nodes nodes = 0;
+	Board new_board = board;
+	do_move<Us, T, Promotion>(new_board, from, to);
+
+	const auto checkers = checks<~Us>(new_board);
+	if (!checkers)
+		return;
+
+	// The piece that moved, or the rook when castling
+	const auto moved = (T == King && distance(from, to) == 2)
+						   ? square_bb(castling_rook_dest(Us, to > from))
+						   : square_bb(to);
+
+	++stats.checks;
+
+	// As in the CPW tables, double checks are not also counted as discovered checks
+	if (more_than_one(checkers))
+		++stats.double_checks;
+	else if (checkers & ~moved)
+		++stats.discovery_checks;
+
+	if (count_moves<~Us>(new_board) == 0)
+		++stats.checkmates;
+}
+
+template <Colour Us, PieceType T, PieceType Promotion = Pawn>
+inline void tally_move(Stats &stats, const Board &board, const Square from, const Square to)
+{
+	const auto enemy = Us == White ? board.black_pieces : board.white_pieces;
+	const bool en_passant = T == Pawn && to == board.en_passant;
+
+	++stats.nodes;
+
+	if ((enemy & to) || en_passant)
+		++stats.captures;
+
+	if (en_passant)
+		++stats.en_passants;
+
+	if (T == King && distance(from, to) == 2)
+		++stats.castles;
+
+	if (Promotion != Pawn)
+		++stats.promotions;
+
+	tally_checks<Us, T, Promotion>(stats, board, from, to);
+}
+
+template <Colour Us, PieceType T>
+inline void tally(Stats &stats, const Board &board, const Square from, const Bitboard to)
+{
+	const auto eksq = Us == White ? board.black_king : board.white_king;
+	const auto enemy = Us == White ? board.black_pieces : board.white_pieces;
+
+	stats.nodes += popcount(to);
+	stats.captures += popcount(to & enemy);
+
+	// Only moves onto a checking square, or off the line by a discoverer, can give check
+	auto candidates = to & check_squares<Us, T>(board, from);
+	if (discoverers<Us>(board) & from)
+		candidates |= to & ~line_connecting(eksq, from);
+
+	while (candidates)
+	{
+		tally_checks<Us, T>(stats, board, from, static_cast<Square>(lsb(candidates)));
+		candidates &= (candidates - 1);
+	}
+}
+
+template <Colour Us, Direction D, bool Promotion>
+inline void tally_pawns(Stats &stats, const Board &board, Bitboard to)
+{
+	if (Promotion)
+	{
+		while (to)
+		{
+			const auto sq = static_cast<Square>(lsb(to));
+			tally_move<Us, Pawn, Knight>(stats, board, sq - D, sq);
+			tally_move<Us, Pawn, Bishop>(stats, board, sq - D, sq);
+			tally_move<Us, Pawn, Rook>(stats, board, sq - D, sq);
+			tally_move<Us, Pawn, Queen>(stats, board, sq - D, sq);
+			to &= (to - 1);
+		}
+
+		return;
+	}
+
+	const auto friendly = Us == White ? board.white_pieces : board.black_pieces;
+	const auto enemy = Us == White ? board.black_pieces : board.white_pieces;
+	const auto discovering = discoverers<Us>(board) & board.pawns & friendly;
+
+	stats.nodes += popcount(to);
+	stats.captures += popcount(to & enemy);
+
+	// Destinations are exactly D ahead of their source squares, so no wrapping can occur
+	auto candidates = to & (check_squares<Us, Pawn>(board, Square::Invalid) |
+							(D > 0 ? discovering << D : discovering >> -D));
+
+	while (candidates)
+	{
+		const auto sq = static_cast<Square>(lsb(candidates));
+		tally_checks<Us, Pawn>(stats, board, sq - D, sq);
+		candidates &= (candidates - 1);
+	}
+}
+
+//
+// Specialised functions for counting at leaf nodes
+//
+
+template <Colour Us, PieceType T, bool Pinned, typename Counter>
+inline Counter count_type(const Board &board, Bitboard pieces, const Bitboard targets);
+
+template <Colour Us, bool Pinned, Material M, typename Counter>
+inline Counter count_pawn_moves(const Board &board, const Bitboard pawns, const Bitboard targets);
+
+template <Colour Us, Material M, typename Counter>
+inline Counter count_evasions(const Board &board, const Bitboard checkers);
+
+template <Colour Us, Material M, typename Counter>
+inline Counter count_moves(const Board &board)
+{
+	Counter nodes {};
+
+	const auto ksq = Us == White ? board.white_king : board.black_king;
+	const auto friendly = Us == White ? board.white_pieces : board.black_pieces;
+	const auto enemy = Us == White ? board.black_pieces : board.white_pieces;
+
+	const auto unsafe = unsafe_squares<Us, M>(board);
+
+	const auto targets = ~friendly;
+	const auto mask = friendly;
+
+	tally<Us, King>(nodes, board, ksq, attacks_from<King>(ksq) & targets & ~unsafe);
+
+	// In check
+	if (unsafe & ksq)
+	{
+		profile<Profile::InCheck>(1);
+
+		const auto checkers = checks<Us, M>(board);
+
+		if (more_than_one(checkers))
+		{
+			profile<Profile::DoubleCheck>(1);
+			return nodes;
+		}
+
+		return nodes + count_evasions<Us, M, Counter>(board, checkers);
+	}
+
+	// Short
+	if ((board.castling_rights.all & castling_rights(Us, true).all) &&
+		!((friendly | enemy) & castling_rook_path(Us, true)) &&
+		!(unsafe & castling_king_path(Us, true)))
+	{
+		tally_move<Us, King>(nodes, board, ksq, castling_king_dest(Us, true));
+		profile<Profile::Castling>(1);
+	}
+
+	// Long
+	if ((board.castling_rights.all & castling_rights(Us, false).all) &&
+		!((friendly | enemy) & castling_rook_path(Us, false)) &&
+		!(unsafe & castling_king_path(Us, false)))
+	{
+		tally_move<Us, King>(nodes, board, ksq, castling_king_dest(Us, false));
+		profile<Profile::Castling>(1);
+	}
+
+	const auto pinned = pinned_pieces<Us, M>(board);
+
+	if (pinned)
+		profile<Profile::Pinned>(1);
+
+	if (M & KnightMaterial)
+		nodes += count_type<Us, Knight, false, Counter>(board, board.knights & mask & ~pinned,
+														targets);
+
+	if (M & DiagonalMaterial)
+		nodes += count_type<Us, Bishop, false, Counter>(
+			board, board.bishops_queens & mask & ~pinned, targets);
+
+	if (M & OrthogonalMaterial)
+		nodes += count_type<Us, Rook, false, Counter>(board, board.rooks_queens & mask & ~pinned,
+													  targets);
+
+	if (M & PawnMaterial)
+		nodes += count_pawn_moves<Us, false, M, Counter>(board, board.pawns & mask & ~pinned,
+														 targets);
+
+	if (M & DiagonalMaterial)
+		nodes += count_type<Us, Bishop, true, Counter>(board, board.bishops_queens & mask & pinned,
+													   targets);
+
+	if (M & OrthogonalMaterial)
+		nodes += count_type<Us, Rook, true, Counter>(board, board.rooks_queens & mask & pinned,
+													 targets);
+
+	if (M & PawnMaterial)
+		nodes += count_pawn_moves<Us, true, M, Counter>(board, board.pawns & mask & pinned,
+														targets);
+
+	return nodes;
+}
+
+template <Colour Us, PieceType T, bool Pinned, typename Counter>
+inline Counter count_type(const Board &board, Bitboard pieces, const Bitboard targets)
+{
+	static_assert(T != King && T != Pawn, "Use count_king_moves/count_pawn_moves instead");
+
+	Counter nodes {};
+
+	const auto ksq = Us == White ? board.white_king : board.black_king;
+	const auto occ = board.white_pieces | board.black_pieces;
+
+	while (pieces)
+	{
+		const auto from = static_cast<Square>(lsb(pieces));
+		auto attacks = attacks_from<T>(from, occ) & targets;
+
+		if (Pinned)
+			attacks &= pin_ray(ksq, from);
+
+		tally<Us, T>(nodes, board, from, attacks);
+
+		pieces &= (pieces - 1);
+	}
+
+	return nodes;
+}
+
+template <Colour Us, bool Pinned, Material M, typename Counter>
+inline Counter count_pawn_moves(const Board &board, const Bitboard pawns, const Bitboard targets)
+{
+	Counter nodes {};
 
 	constexpr auto Rank3 = Us == White ? Rank::Three : Rank::Six;
 	constexpr auto Rank7 = Us == White ? Rank::Seven : Rank::Two;
@@ -2418,136 +3363,717 @@ inline Nodes count_pawn_moves(const Board &board, const Bitboard pawns, const Bi
 					(attacks_from<Rook>(ksq, new_occ) & board.rooks_queens & enemy))
 					continue;
 
-				++nodes;
+				tally_move<Us, Pawn>(nodes, board, from, board.en_passant);
+				profile<Profile::EnPassant>(1);
 			}
 		}
 	}
 
-	const auto pawns_on_7 = pawns & Rank7, pawns_not_on_7 = pawns & ~pawns_on_7;
+	// Pinned pawns may only move along their pin ray: pawns pinned on the king's file
+	// can only push, pawns pinned on a diagonal can only capture along it.
+	const auto pushers = Pinned ? pawns & file_bb(ksq) : pawns;
+	const auto west_capturers = Pinned ? pawns & line_through<UpWest>(ksq) : pawns;
+	const auto east_capturers = Pinned ? pawns & line_through<UpEast>(ksq) : pawns;
 
 	// Pawn push, w/o promotion
-	const auto single_push = shift<Up>(pawns_not_on_7) & empty;
+	const auto single_push = shift<Up>(pushers & ~rank_bb(Rank7)) & empty;
 	auto bb = single_push & targets;
 
+	tally_pawns<Us, Up, false>(nodes, board, bb);
+
+	// Double pawn push
+	bb = shift<Up>(single_push & Rank3) & empty & targets;
+
+	tally_pawns<Us, Direction(2 * Up), false>(nodes, board, bb);
+
+	// Promotions, w/o captures
 	if (!Pinned)
-		nodes += popcount(bb);
-	else
 	{
-		while (bb)
+		bb = shift<Up>(pushers & Rank7) & empty & targets;
+		tally_pawns<Us, Up, true>(nodes, board, bb);
+		profile<Profile::Promotion>(1, 4 * popcount(bb));
+	}
+
+	// Captures, w/o promotion, 1/2
+	bb = shift<UpWest>(west_capturers & ~rank_bb(Rank7)) & enemy & targets;
+	tally_pawns<Us, UpWest, false>(nodes, board, bb);
+
+	// Captures, w/o promotion, 2/2
+	bb = shift<UpEast>(east_capturers & ~rank_bb(Rank7)) & enemy & targets;
+	tally_pawns<Us, UpEast, false>(nodes, board, bb);
+
+	// Captures, w/ promotion, 1/2
+	bb = shift<UpWest>(west_capturers & Rank7) & enemy & targets;
+	tally_pawns<Us, UpWest, true>(nodes, board, bb);
+	profile<Profile::Promotion>(1, 4 * popcount(bb));
+
+	// Captures, w/ promotion, 2/2
+	bb = shift<UpEast>(east_capturers & Rank7) & enemy & targets;
+	tally_pawns<Us, UpEast, true>(nodes, board, bb);
+	profile<Profile::Promotion>(1, 4 * popcount(bb));
+
+	return nodes;
+}
+
+template <Colour Us, Material M, typename Counter>
+inline Counter count_evasions(const Board &board, const Bitboard checkers)
+{
+	Counter nodes {};
+
+	const auto e = evaders<Us, M>(board, checkers);
+
+	if (M & KnightMaterial)
+		nodes += count_type<Us, Knight, false, Counter>(board, e.knights, e.targets);
+
+	if (M & DiagonalMaterial)
+		nodes += count_type<Us, Bishop, false, Counter>(board, e.bishops_queens, e.targets);
+
+	if (M & OrthogonalMaterial)
+		nodes += count_type<Us, Rook, false, Counter>(board, e.rooks_queens, e.targets);
+
+	if (M & PawnMaterial)
+		nodes += count_pawn_moves<Us, false, M, Counter>(board, e.pawns, e.targets);
+
+	return nodes;
+}
+
+//
+// Batch perft
+//  perft_many() counts many (typically shallow) positions at once. The boards are split by
+//  side to move, so each call goes straight to that colour's material table, and the boards
+//  are shared out between threads in blocks of consecutive boards. At depth 1 the leaf counter
+//  count_moves() is called directly; it already counts each piece's moves with one popcount.
+//
+
+template <Colour Us, std::size_t... Ms>
+constexpr auto make_count_material_lut(std::index_sequence<Ms...>)
+{
+	return std::array {&count_moves<Us, static_cast<Material>(Ms), Nodes>...};
+}
+
+template <Colour Us>
+static constexpr auto CountByMaterial =
+	make_count_material_lut<Us>(std::make_index_sequence<MaterialSignatures>());
+
+// Boards per block handed to a thread
+constexpr std::size_t PerftManyBlock = 1024;
+
+// Perft of the boards at 'index' (all with Us to move)
+template <Colour Us>
+inline void perft_block(const Board *boards, const std::size_t *index, const std::size_t count,
+						const Depth depth, Nodes *nodes)
+{
+	if (depth == 1)
+	{
+		for (std::size_t i = 0; i < count; ++i)
 		{
-			const auto to = static_cast<Square>(lsb(bb));
-			const auto from = to - Up;
-			bb &= (bb - 1);
+			const auto &board = boards[index[i]];
+			profile<Profile::Positions>(1);
+			nodes[index[i]] = CountByMaterial<Us>[material(board)](board);
+		}
+	}
+	else
+	{
+		for (std::size_t i = 0; i < count; ++i)
+			nodes[index[i]] = perft_dispatch<Us>(boards[index[i]], depth);
+	}
+}
+
+// Writes the perft of each of boards[0...count) to nodes[0...count), using up to 'threads'
+// threads
+inline void perft_many(const Board *boards, const std::size_t count, const Depth depth,
+					   Nodes *nodes, const unsigned threads = 1)
+{
+	if (depth == 0)
+	{
+		std::fill(nodes, nodes + count, Nodes {1});
+		return;
+	}
+
+	// Indices of the boards with white to move, then those with black to move
+	std::vector<std::size_t> index(count);
+	auto white = index.begin(), black = index.end();
 
-			if (!aligned(ksq, from, to))
-				continue;
+	for (std::size_t i = 0; i < count; ++i)
+		*(boards[i].side == White ? white++ : --black) = i;
 
-			++nodes;
+	std::reverse(black, index.end());
+
+	const auto whites = static_cast<std::size_t>(white - index.begin());
+	const auto white_blocks = (whites + PerftManyBlock - 1) / PerftManyBlock;
+	const auto blocks = white_blocks + (count - whites + PerftManyBlock - 1) / PerftManyBlock;
+
+	std::atomic<std::size_t> next {0};
+
+	const auto work = [&] {
+		for (auto b = next++; b < blocks; b = next++)
+		{
+			// Blocks don't straddle the colours
+			const auto begin = b < white_blocks ? b * PerftManyBlock
+												: whites + (b - white_blocks) * PerftManyBlock;
+			const auto end = util::min(begin + PerftManyBlock, b < white_blocks ? whites : count);
+
+			if (b < white_blocks)
+				perft_block<White>(boards, &index[begin], end - begin, depth, nodes);
+			else
+				perft_block<Black>(boards, &index[begin], end - begin, depth, nodes);
 		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < util::min<std::size_t>(threads, blocks); ++i)
+		workers.emplace_back(work);
+
+	work();
+
+	for (auto &worker : workers)
+		worker.join();
+}
+
+inline std::vector<Nodes> perft_many(const std::vector<Board> &boards, const Depth depth,
+									 const unsigned threads = 1)
+{
+	std::vector<Nodes> nodes(boards.size());
+	perft_many(boards.data(), boards.size(), depth, nodes.data(), threads);
+
+	return nodes;
+}
+
+//
+// Perft estimation
+//  Knuth's estimator: the product of the branching factors along a uniformly random path
+//  is an unbiased estimate of the number of leaves. The last 'exact' plies are counted with
+//  perft instead of sampled, which costs a little per sample but removes most of the variance.
+//
+
+struct Estimate
+{
+	std::uint64_t samples = 0;
+	double mean = 0, m2 = 0; // Welford's running mean and sum of squared deviations
+
+	void add(const double x)
+	{
+		++samples;
+
+		const auto delta = x - mean;
+		mean += delta / samples;
+		m2 += delta * (x - mean);
 	}
 
-	// Double pawn push
-	bb = shift<Up>(single_push & Rank3) & empty & targets;
+	Estimate &operator+=(const Estimate &other)
+	{
+		if (other.samples == 0)
+			return *this;
 
-	if (!Pinned)
-		nodes += popcount(bb);
-	else
+		const auto n = samples + other.samples;
+		const auto delta = other.mean - mean;
+
+		mean += delta * other.samples / n;
+		m2 += other.m2 + delta * delta * samples * other.samples / n;
+		samples = n;
+
+		return *this;
+	}
+
+	// Half-width of the confidence interval on the mean (z = 1.96 for 95%)
+	double interval(const double z = 1.96) const
 	{
-		while (bb)
-		{
-			const auto to = static_cast<Square>(lsb(bb));
-			const auto from = to - Up * 2;
-			bb &= (bb - 1);
+		return samples > 1 ? z * std::sqrt(m2 / (samples - 1) / samples) : HUGE_VAL;
+	}
+};
+
+inline double estimate_sample(Board board, const Depth depth, const Depth exact,
+							  std::mt19937_64 &rng)
+{
+	double weight = 1;
 
-			if (!aligned(ksq, from, to))
-				continue;
+	for (Depth d = depth; d > exact; --d)
+	{
+		const auto moves = legal_moves(board);
+		if (moves.size == 0)
+			return 0;
 
-			++nodes;
-		}
+		weight *= moves.size;
+		make_move(board, moves[std::uniform_int_distribution<std::size_t>(0, moves.size - 1)(rng)]);
 	}
 
-	// Promotions, w/o captures
-	if (!Pinned)
+	const auto nodes = board.side == White ? perft_dispatch<White>(board, exact)
+										   : perft_dispatch<Black>(board, exact);
+
+	return weight * nodes;
+}
+
+// Samples until 'samples' have been taken or the time budget (if non-zero) runs out
+inline Estimate estimate_perft(const Board &board, const Depth depth, const std::uint64_t samples,
+							   const std::chrono::milliseconds budget, const unsigned threads,
+							   const Depth exact = 2, const std::uint64_t seed = 0)
+{
+	using Clock = std::chrono::steady_clock;
+	const auto deadline = Clock::now() + budget;
+
+	std::atomic<std::uint64_t> next {0};
+	std::vector<Estimate> estimates(threads);
+	std::vector<std::thread> workers;
+
+	for (unsigned i = 0; i < threads; ++i)
 	{
-		bb = shift<Up>(pawns_on_7) & empty & targets;
-		nodes += popcount(bb) * 4;
+		workers.emplace_back([&, i] {
+			std::mt19937_64 rng(seed + i);
+
+			while (next.fetch_add(1, std::memory_order_relaxed) < samples &&
+				   (budget.count() == 0 || Clock::now() < deadline))
+				estimates[i].add(estimate_sample(board, depth, util::min(exact, depth), rng));
+		});
 	}
 
-	// Captures, w/o promotion, 1/2
-	bb = shift<UpWest>(pawns_not_on_7) & enemy & targets;
-	if (!Pinned)
-		nodes += popcount(bb);
-	else
+	Estimate estimate;
+
+	for (unsigned i = 0; i < threads; ++i)
 	{
-		while (bb)
-		{
-			const auto to = static_cast<Square>(lsb(bb));
-			const auto from = to - UpWest;
-			bb &= (bb - 1);
+		workers[i].join();
+		estimate += estimates[i];
+	}
 
-			if (!aligned(ksq, from, to))
-				continue;
+	return estimate;
+}
 
-			++nodes;
-		}
+//
+// Unique position counting
+//  Counts the distinct positions (rather than move paths) at exactly depth N, breadth-first:
+//  the distinct positions at each ply are expanded to give those at the next. Positions are
+//  packed into PositionKeys and collected in per-thread buffers; a full buffer is sorted and
+//  deduplicated, and spilled to a temporary file as a sorted run if that didn't free enough
+//  space. A ply is read back by merging its buffers and runs, visiting each key once.
+//
+
+struct PositionKey
+{
+	// Bitboards, then kings, castling rights, side to move and en passant square
+	std::array<std::uint64_t, 7> words;
+
+	bool operator<(const PositionKey &other) const
+	{
+		return words < other.words;
 	}
 
-	// Captures, w/o promotion, 2/2
-	bb = shift<UpEast>(pawns_not_on_7) & enemy & targets;
-	if (!Pinned)
-		nodes += popcount(bb);
-	else
+	bool operator==(const PositionKey &other) const
 	{
-		while (bb)
-		{
-			const auto to = static_cast<Square>(lsb(bb));
-			const auto from = to - UpEast;
-			bb &= (bb - 1);
+		return words == other.words;
+	}
+};
 
-			if (!aligned(ksq, from, to))
-				continue;
+// Whether the side to move has a legal en passant capture
+template <Colour Us> inline bool en_passant_legal(const Board &board)
+{
+	if (!is_valid(board.en_passant))
+		return false;
 
-			++nodes;
-		}
+	const auto friendly = Us == White ? board.white_pieces : board.black_pieces;
+
+	for (auto bb = pawn_attacks(~Us, board.en_passant) & board.pawns & friendly; bb; bb &= (bb - 1))
+	{
+		Board new_board = board;
+		do_move<Us, Pawn>(new_board, static_cast<Square>(lsb(bb)), board.en_passant);
+
+		if (!checks<Us>(new_board))
+			return true;
 	}
 
-	// Captures, w/ promotion, 1/2
-	bb = shift<UpWest>(pawns_on_7) & enemy & targets;
-	if (!Pinned)
-		nodes += popcount(bb) * 4;
-	else
+	return false;
+}
+
+inline PositionKey position_key(const Board &board)
+{
+	// The en passant square only distinguishes positions if the capture is legal
+	const auto ep = (board.side == White ? en_passant_legal<White>(board)
+										 : en_passant_legal<Black>(board))
+						? board.en_passant
+						: Square::Invalid;
+
+	const auto state = std::uint64_t(to_int(board.white_king)) |
+					   std::uint64_t(to_int(board.black_king)) << 8 |
+					   std::uint64_t(board.castling_rights.all) << 16 |
+					   std::uint64_t(board.side) << 24 | std::uint64_t(to_int(ep)) << 32;
+
+	return {{board.white_pieces, board.black_pieces, board.pawns, board.knights,
+			 board.bishops_queens, board.rooks_queens, state}};
+}
+
+inline Board position_board(const PositionKey &key)
+{
+	Board board;
+
+	board.white_pieces = key.words[0];
+	board.black_pieces = key.words[1];
+	board.pawns = key.words[2];
+	board.knights = key.words[3];
+	board.bishops_queens = key.words[4];
+	board.rooks_queens = key.words[5];
+
+	const auto state = key.words[6];
+	board.white_king = static_cast<Square>(state & 0xff);
+	board.black_king = static_cast<Square>((state >> 8) & 0xff);
+	board.castling_rights.all = (state >> 16) & 0xf;
+	board.side = static_cast<Colour>((state >> 24) & 1);
+	board.en_passant = static_cast<Square>((state >> 32) & 0xff);
+
+	return board;
+}
+
+//
+// Symmetry
+//  A position and its colour flip (ranks reversed, colours and side to move swapped) have the
+//  same perft, as do a position and its file mirror if neither side can castle. Keys of the
+//  canonical image let position sets and caches share one entry between symmetric positions.
+//
+
+// Reverses the ranks (a1 <-> a8), i.e. a byte swap
+constexpr Bitboard flip_ranks(Bitboard bb)
+{
+	bb = ((bb >> 8) & 0x00ff00ff00ff00ffull) | ((bb & 0x00ff00ff00ff00ffull) << 8);
+	bb = ((bb >> 16) & 0x0000ffff0000ffffull) | ((bb & 0x0000ffff0000ffffull) << 16);
+
+	return (bb >> 32) | (bb << 32);
+}
+
+// Reverses the files (a1 <-> h1), i.e. the bits of each byte
+constexpr Bitboard flip_files(Bitboard bb)
+{
+	bb = ((bb >> 1) & 0x5555555555555555ull) | ((bb & 0x5555555555555555ull) << 1);
+	bb = ((bb >> 2) & 0x3333333333333333ull) | ((bb & 0x3333333333333333ull) << 2);
+
+	return ((bb >> 4) & 0x0f0f0f0f0f0f0f0full) | ((bb & 0x0f0f0f0f0f0f0f0full) << 4);
+}
+
+constexpr Square flip_rank(const Square sq)
+{
+	return is_valid(sq) ? static_cast<Square>(to_int(sq) ^ 56) : sq;
+}
+
+constexpr Square flip_file(const Square sq)
+{
+	return is_valid(sq) ? static_cast<Square>(to_int(sq) ^ 7) : sq;
+}
+
+inline Board colour_flip(const Board &board)
+{
+	Board flipped;
+
+	flipped.white_pieces = flip_ranks(board.black_pieces);
+	flipped.black_pieces = flip_ranks(board.white_pieces);
+	flipped.pawns = flip_ranks(board.pawns);
+	flipped.knights = flip_ranks(board.knights);
+	flipped.bishops_queens = flip_ranks(board.bishops_queens);
+	flipped.rooks_queens = flip_ranks(board.rooks_queens);
+	flipped.white_king = flip_rank(board.black_king);
+	flipped.black_king = flip_rank(board.white_king);
+	flipped.castling_rights.all = (board.castling_rights.black) |
+								  (board.castling_rights.white << 2);
+	flipped.side = ~board.side;
+	flipped.en_passant = flip_rank(board.en_passant);
+
+	return flipped;
+}
+
+// Only has the same perft if there are no castling rights
+inline Board file_mirror(const Board &board)
+{
+	Board mirrored = board;
+
+	mirrored.white_pieces = flip_files(board.white_pieces);
+	mirrored.black_pieces = flip_files(board.black_pieces);
+	mirrored.pawns = flip_files(board.pawns);
+	mirrored.knights = flip_files(board.knights);
+	mirrored.bishops_queens = flip_files(board.bishops_queens);
+	mirrored.rooks_queens = flip_files(board.rooks_queens);
+	mirrored.white_king = flip_file(board.white_king);
+	mirrored.black_king = flip_file(board.black_king);
+	mirrored.en_passant = flip_file(board.en_passant);
+
+	return mirrored;
+}
+
+// The key of the board's image with white to move, or the smaller key of that and its file
+// mirror if there are no castling rights. Boards with equal keys have equal perfts.
+inline PositionKey canonical_key(const Board &board)
+{
+	const auto white = board.side == White ? board : colour_flip(board);
+	const auto key = position_key(white);
+
+	return white.castling_rights.all ? key : util::min(key, position_key(file_mirror(white)));
+}
+
+inline Board canonical(const Board &board)
+{
+	return position_board(canonical_key(board));
+}
+
+// Sorted, deduplicated positions (in memory) and sorted runs of positions (on disk)
+class PositionBuffer
+{
+public:
+	explicit PositionBuffer(const std::size_t capacity)
+		: capacity(util::max<std::size_t>(capacity, 2))
 	{
-		while (bb)
+		keys.reserve(this->capacity);
+	}
+
+	~PositionBuffer()
+	{
+		for (auto run : runs)
+			std::fclose(run);
+	}
+
+	PositionBuffer(const PositionBuffer &) = delete;
+	PositionBuffer &operator=(const PositionBuffer &) = delete;
+
+	void insert(const PositionKey &key)
+	{
+		keys.push_back(key);
+
+		if (keys.size() == capacity)
+			compact();
+	}
+
+	// Sorts and deduplicates the buffer, spilling it to disk if it's still at least half full
+	void compact()
+	{
+		std::sort(keys.begin(), keys.end());
+		keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+		if (keys.size() < capacity / 2)
+			return;
+
+		auto run = std::tmpfile();
+		if (!run || std::fwrite(keys.data(), sizeof(PositionKey), keys.size(), run) != keys.size())
+			throw std::runtime_error("unable to write position run to a temporary file");
+
+		std::rewind(run);
+		runs.push_back(run);
+		keys.clear();
+	}
+
+	std::size_t capacity;
+	std::vector<PositionKey> keys;
+	std::vector<std::FILE *> runs;
+};
+
+// Reads sorted keys from a run on disk, or from a sorted in-memory buffer if 'file' is null
+class PositionReader
+{
+public:
+	PositionReader(std::FILE *file, const std::vector<PositionKey> &keys)
+		: file(file), data(keys.data()), size(keys.size())
+	{
+		if (file)
 		{
-			const auto to = static_cast<Square>(lsb(bb));
-			const auto from = to - UpWest;
-			bb &= (bb - 1);
+			buffer.resize(1 << 14);
+			refill();
+		}
+	}
+
+	bool empty() const
+	{
+		return pos == size;
+	}
+
+	const PositionKey &peek() const
+	{
+		return data[pos];
+	}
+
+	void pop()
+	{
+		if (++pos == size && file)
+			refill();
+	}
+
+private:
+	void refill()
+	{
+		size = std::fread(buffer.data(), sizeof(PositionKey), buffer.size(), file);
+		data = buffer.data();
+		pos = 0;
+	}
 
-			if (!aligned(ksq, from, to))
-				continue;
+	std::FILE *file;
+	std::vector<PositionKey> buffer;
+	const PositionKey *data;
+	std::size_t size, pos = 0;
+};
 
-			nodes += 4;
+// The positions at one ply, collected in a buffer per thread
+class PositionSet
+{
+public:
+	PositionSet(const std::size_t memory, const unsigned threads)
+	{
+		for (unsigned i = 0; i < threads; ++i)
+		{
+			const auto capacity = memory / threads / sizeof(PositionKey);
+			buffers.push_back(std::make_unique<PositionBuffer>(capacity));
 		}
 	}
 
-	// Captures, w/ promotion, 2/2
-	bb = shift<UpEast>(pawns_on_7) & enemy & targets;
-	if (!Pinned)
-		nodes += popcount(bb) * 4;
-	else
+	PositionBuffer &operator[](const unsigned i)
 	{
-		while (bb)
+		return *buffers[i];
+	}
+
+	void compact()
+	{
+		for (auto &buffer : buffers)
+			buffer->compact();
+	}
+
+	std::size_t runs() const
+	{
+		std::size_t n = 0;
+		for (const auto &buffer : buffers)
+			n += buffer->runs.size();
+
+		return n;
+	}
+
+	// Calls f(key) for each distinct position in key order, reading each run once.
+	// Returns the number of distinct positions.
+	template <typename F> Nodes for_each(F &&f)
+	{
+		std::vector<PositionReader> readers;
+
+		for (const auto &buffer : buffers)
 		{
-			const auto to = static_cast<Square>(lsb(bb));
-			const auto from = to - UpEast;
-			bb &= (bb - 1);
+			readers.emplace_back(nullptr, buffer->keys);
+
+			for (auto run : buffer->runs)
+				readers.emplace_back(run, buffer->keys);
+		}
 
-			if (!aligned(ksq, from, to))
-				continue;
+		const auto greater = [&](const std::size_t a, const std::size_t b) {
+			return readers[b].peek() < readers[a].peek();
+		};
 
-			nodes += 4;
+		std::priority_queue<std::size_t, std::vector<std::size_t>, decltype(greater)> heap(greater);
+
+		for (std::size_t i = 0; i < readers.size(); ++i)
+			if (!readers[i].empty())
+				heap.push(i);
+
+		Nodes positions = 0;
+		PositionKey last {};
+
+		while (!heap.empty())
+		{
+			const auto i = heap.top();
+			heap.pop();
+
+			if (positions == 0 || !(readers[i].peek() == last))
+			{
+				last = readers[i].peek();
+				f(last);
+				++positions;
+			}
+
+			readers[i].pop();
+			if (!readers[i].empty())
+				heap.push(i);
 		}
+
+		return positions;
 	}
 
-	return nodes;
+private:
+	std::vector<std::unique_ptr<PositionBuffer>> buffers;
+};
+
+struct UniqueCount
+{
+	Nodes positions = 0;
+	std::size_t runs = 0; // Spilled to disk, over all plies
+};
+
+// Counts the distinct positions at exactly 'depth', in at most about 'memory' bytes of keys.
+// If 'symmetric', positions are only counted once per canonical_key(), which here only merges
+// file mirrors since all the positions of a ply have the same side to move.
+inline UniqueCount count_unique(const Board &board, const Depth depth, const std::size_t memory,
+								const unsigned threads, const bool symmetric = false)
+{
+	const auto key = symmetric ? canonical_key : position_key;
+
+	constexpr std::size_t ChunkSize = 1 << 16;
+
+	UniqueCount count;
+
+	// The current ply and the next are held at once, so each gets half the memory
+	auto current = std::make_unique<PositionSet>(memory / 2, threads);
+	(*current)[0].insert(key(board));
+
+	for (Depth ply = 0; ply < depth; ++ply)
+	{
+		auto next = std::make_unique<PositionSet>(memory / 2, threads);
+
+		std::vector<PositionKey> chunk;
+		chunk.reserve(ChunkSize);
+
+		// Expands a chunk of parents, with each thread writing to its own buffer. A buffer
+		// spilling to disk can throw, so each thread keeps its exception for after the join
+		const auto expand = [&] {
+			std::atomic<std::size_t> index {0};
+			std::vector<std::exception_ptr> errors(threads);
+
+			const auto work = [&](const unsigned i) {
+				try
+				{
+					for (auto j = index++; j < chunk.size(); j = index++)
+					{
+						const auto parent = position_board(chunk[j]);
+
+						for (const auto &move : legal_moves(parent))
+						{
+							Board child = parent;
+							make_move(child, move);
+							(*next)[i].insert(key(child));
+						}
+					}
+				}
+				catch (...)
+				{
+					errors[i] = std::current_exception();
+					index = chunk.size();
+				}
+			};
+
+			std::vector<std::thread> workers;
+			for (unsigned i = 1; i < threads; ++i)
+				workers.emplace_back(work, i);
+
+			work(0);
+
+			for (auto &worker : workers)
+				worker.join();
+
+			for (const auto &error : errors)
+				if (error)
+					std::rethrow_exception(error);
+
+			chunk.clear();
+		};
+
+		current->for_each([&](const PositionKey &key) {
+			chunk.push_back(key);
+
+			if (chunk.size() == ChunkSize)
+				expand();
+		});
+
+		expand();
+
+		next->compact();
+		count.runs += next->runs();
+		current = std::move(next);
+	}
+
+	count.positions = current->for_each([](const PositionKey &) {});
+
+	return count;
 }